@@ -0,0 +1,137 @@
+#include "solver.cpp"
+#include <deque>
+#include <fstream>
+#include <iostream>
+#include <string>
+#include <chrono>
+
+/**
+ * usage: batch [FILE] [--book FILE] [--table-mb MB] [--table-file PATH] [--window N]
+ *              [--target POS_PER_SEC] [--stats]
+ *
+ * Reads one position per line as a move string (1-WIDTH), from FILE or stdin,
+ * and writes "<moves> <score> <best column> <micros>" per line in input
+ * order. Lines that aren't a legal, unfinished game get "<moves> invalid",
+ * blank lines are skipped. Positions in the book (8-ply.bin by default)
+ * are looked up instead of searched.
+ *
+ * At most window positions are in flight at once, so memory stays flat no
+ * matter how long the input is. A summary goes to stderr at the end, and
+ * the exit code is 1 if throughput fell below --target. With --stats the
+ * summary also has the search counters summed over every position.
+ */
+
+struct result {
+    std::string moves;
+    bool valid = false;
+    int score = 0;
+    int best = -1;
+    int64_t micros = 0;
+    solver::search_stats stats;
+};
+
+int main(int argc, char **argv) {
+    std::string file_name, book_file = "8-ply.bin";
+    size_t window = 0;
+    double target = 0;
+    bool print_stats = false;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if ((arg == "--table-mb" || arg == "--table-file") && i + 1 < argc) {
+            i++;
+        } else if (arg == "--book" && i + 1 < argc) {
+            book_file = argv[++i];
+        } else if (arg == "--window" && i + 1 < argc) {
+            window = std::stoul(argv[++i]);
+        } else if (arg == "--target" && i + 1 < argc) {
+            target = std::stod(argv[++i]);
+        } else if (arg == "--stats") {
+            print_stats = true;
+        } else {
+            file_name = arg;
+        }
+    }
+
+    solver::init(solver::memory_budget(argc, argv), solver::table_file(argc, argv));
+    solver::book.load(book_file);
+
+    // positions are solved in parallel, one per worker
+    solver::helpers = 0;
+    solver::collect_stats = print_stats;
+    if (window == 0) window = 64 * solver::tasks.size();
+
+    std::ifstream fin;
+    if (!file_name.empty()) {
+        fin.open(file_name);
+        if (!fin) {
+            std::cerr << "failed to open " << file_name << '\n';
+            return 1;
+        }
+    }
+
+    std::istream &in = file_name.empty() ? std::cin : fin;
+
+    std::deque<std::future<result>> pending;
+    size_t solved = 0;
+    solver::search_stats totals;
+    int64_t total_micros = 0, max_micros = 0;
+
+    const auto flush_one = [&] {
+        result res = pending.front().get();
+        pending.pop_front();
+
+        if (!res.valid) {
+            std::cout << res.moves << " invalid\n";
+            return;
+        }
+
+        std::cout << res.moves << ' ' << res.score << ' ' << res.best + 1 << ' ' << res.micros << '\n';
+        solved++;
+        totals += res.stats;
+        total_micros += res.micros;
+        max_micros = std::max(max_micros, res.micros);
+    };
+
+    auto start = std::chrono::steady_clock::now();
+
+    std::string line;
+    while (std::getline(in, line)) {
+        if (!line.empty() && line.back() == '\r') line.pop_back();
+        if (line.empty()) continue;
+        if (pending.size() >= window) flush_one();
+
+        pending.push_back(solver::tasks.submit([moves = std::move(line)]() mutable {
+            result res;
+            auto cur = position::parse(moves);
+            res.moves = std::move(moves);
+            if (!cur) return res;
+
+            auto begin = std::chrono::steady_clock::now();
+            std::tie(res.best, res.score) = solver::score_and_move(*cur, false, &res.stats);
+            auto end = std::chrono::steady_clock::now();
+
+            res.valid = true;
+            res.micros = std::chrono::duration_cast<std::chrono::microseconds>(end - begin).count();
+            return res;
+        }));
+    }
+
+    while (!pending.empty()) flush_one();
+    std::cout.flush();
+
+    auto end = std::chrono::steady_clock::now();
+    double seconds = std::chrono::duration<double>(end - start).count();
+    double rate = seconds > 0 ? solved / seconds : 0;
+
+    std::cerr << "positions: " << solved << '\n'
+              << "seconds: " << seconds << '\n'
+              << "positions/sec: " << rate << '\n'
+              << "mean micros: " << (solved ? total_micros / int64_t(solved) : 0) << '\n'
+              << "max micros: " << max_micros << '\n';
+    if (print_stats) std::cerr << "stats: " << totals << '\n';
+
+    if (target > 0 && rate < target) {
+        std::cerr << "below target of " << target << " positions/sec\n";
+        return 1;
+    }
+}
@@ -0,0 +1,244 @@
+#include "solver.cpp"
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <filesystem>
+#include <fstream>
+#include <iostream>
+#include <random>
+#include <string>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * usage: bench --generate DIR [--count N] [--seed S] [--table-mb MB] [--table-file PATH]
+ *        bench [--warm] [--weak] [--history] [--no-etc] [--endgame N] [--helpers N]
+ *              [--table-mb MB] [--table-file PATH] [--json FILE] SET...
+ *
+ * --generate writes the standard test sets to DIR, as "<moves> <score>"
+ * lines like the Pons test files. Positions come from random games and
+ * are grouped by phase (how many moves were played) and difficulty (how
+ * many nodes it took to solve them):
+ *  begin_easy, begin_hard:   8-15 moves played
+ *  middle_easy, middle_hard: 16-27 moves played
+ *  end_easy:                 28-36 moves played
+ *
+ * Otherwise, every SET file is solved one position at a time and checked
+ * against its expected scores. The table is emptied before each position
+ * so node counts are reproducible, unless --warm is given. --weak only
+ * checks win/draw/loss, --history turns on solver::history_ordering,
+ * --no-etc turns off solver::enhanced_cutoffs and --endgame sets
+ * solver::endgame_depth (0 turns the endgame solver off). The results go
+ * to stdout (or FILE) as JSON, a short summary goes to stderr.
+ */
+
+struct band {
+    std::string name;
+    int min_moves;
+    int max_moves;
+    uint64_t min_nodes;
+    uint64_t max_nodes;
+};
+
+constexpr uint64_t HARD_NODES = 100000;
+
+const std::vector<band> BANDS = {
+    {"begin_easy", 8, 15, 0, HARD_NODES},
+    {"begin_hard", 8, 15, HARD_NODES, UINT64_MAX},
+    {"middle_easy", 16, 27, 0, HARD_NODES},
+    {"middle_hard", 16, 27, HARD_NODES, UINT64_MAX},
+    {"end_easy", 28, 36, 0, UINT64_MAX},
+};
+
+/**
+ * @return moves of a random game of the given length in which nobody has
+ *         won and the player to move can't win or be forced to lose at once,
+ *         or an empty string if the game ran into one of those
+ */
+std::string random_game(std::mt19937_64 &rng, int length) {
+    position cur;
+    std::string moves;
+    for (int i = 0; i < length; i++) {
+        int options[position::WIDTH], count = 0;
+        for (int col = 0; col < position::WIDTH; col++) {
+            if (cur.can_play(col) && !cur.is_winning_move(col)) options[count++] = col;
+        }
+
+        if (count == 0) return "";
+        int col = options[rng() % count];
+        cur.play_col(col);
+        moves += char('1' + col);
+    }
+
+    if (cur.has_winning_move() || !cur.non_losing_moves()) return "";
+    return moves;
+}
+
+int generate(const std::string &dir, size_t count, uint64_t seed) {
+    std::filesystem::create_directories(dir);
+    std::mt19937_64 rng(seed);
+    solver::helpers = 0;
+
+    for (const auto &b : BANDS) {
+        std::vector<std::pair<std::string, int>> kept;
+        std::unordered_set<std::string> seen;
+
+        // candidates are drawn in rounds, since how hard a position is
+        // is only known once it is solved
+        for (int round = 0; kept.size() < count && round < 64; round++) {
+            std::vector<std::string> candidates;
+            while (candidates.size() < 4 * count) {
+                int length = b.min_moves + rng() % (b.max_moves - b.min_moves + 1);
+                auto moves = random_game(rng, length);
+                if (!moves.empty() && seen.insert(moves).second) candidates.push_back(moves);
+            }
+
+            std::vector<int> scores(candidates.size());
+            std::vector<uint64_t> nodes(candidates.size());
+            solver::tasks.submit_range(0, candidates.size(), [&](size_t i) {
+                solver::search_stats counted;
+                scores[i] = solver::solve(position(candidates[i]), false, &counted);
+                nodes[i] = counted.nodes;
+            }).get();
+
+            for (size_t i = 0; i < candidates.size() && kept.size() < count; i++) {
+                if (nodes[i] >= b.min_nodes && nodes[i] < b.max_nodes) kept.push_back({candidates[i], scores[i]});
+            }
+        }
+
+        std::ofstream fout(dir + "/" + b.name + ".txt");
+        for (const auto &[moves, score] : kept) fout << moves << ' ' << score << '\n';
+        std::cerr << b.name << ": " << kept.size() << " positions\n";
+    }
+
+    return 0;
+}
+
+struct set_result {
+    std::string name;
+    size_t positions = 0;
+    size_t mismatches = 0;
+    double mean_us = 0, p50_us = 0, p99_us = 0;
+    solver::search_stats stats;
+    double seconds = 0;
+};
+
+set_result run_set(const std::string &file_name, bool warm, bool weak) {
+    set_result res;
+    res.name = std::filesystem::path(file_name).stem().string();
+
+    std::ifstream fin(file_name);
+    std::string moves;
+    int expected;
+    std::vector<double> times;
+
+    while (fin >> moves >> expected) {
+        if (!warm) solver::reset();
+        solver::memo.next_generation();
+        position cur(moves);
+
+        auto start = std::chrono::steady_clock::now();
+        int score = solver::solve(cur, weak, &res.stats);
+        auto end = std::chrono::steady_clock::now();
+
+        double us = std::chrono::duration<double, std::micro>(end - start).count();
+        times.push_back(us);
+        res.seconds += us / 1e6;
+        if (weak) expected = (expected > 0) - (expected < 0);
+        if (score != expected) res.mismatches++;
+    }
+
+    res.positions = times.size();
+    if (!times.empty()) {
+        std::sort(times.begin(), times.end());
+        res.mean_us = res.seconds * 1e6 / times.size();
+        res.p50_us = times[times.size() / 2];
+        res.p99_us = times[std::min(times.size() - 1, times.size() * 99 / 100)];
+    }
+
+    return res;
+}
+
+int main(int argc, char **argv) {
+    std::string generate_dir, json_file;
+    size_t count = 100;
+    uint64_t seed = 1;
+    bool warm = false, weak = false;
+    std::vector<std::string> sets;
+
+    solver::helpers = 0;
+    solver::collect_stats = true;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--generate" && i + 1 < argc) {
+            generate_dir = argv[++i];
+        } else if (arg == "--count" && i + 1 < argc) {
+            count = std::stoul(argv[++i]);
+        } else if (arg == "--seed" && i + 1 < argc) {
+            seed = std::stoull(argv[++i]);
+        } else if (arg == "--json" && i + 1 < argc) {
+            json_file = argv[++i];
+        } else if (arg == "--helpers" && i + 1 < argc) {
+            solver::helpers = std::stoi(argv[++i]);
+        } else if ((arg == "--table-mb" || arg == "--table-file") && i + 1 < argc) {
+            i++;
+        } else if (arg == "--warm") {
+            warm = true;
+        } else if (arg == "--weak") {
+            weak = true;
+        } else if (arg == "--history") {
+            solver::history_ordering = true;
+        } else if (arg == "--no-etc") {
+            solver::enhanced_cutoffs = false;
+        } else if (arg == "--endgame" && i + 1 < argc) {
+            solver::endgame_depth = std::min(std::stoi(argv[++i]), endgame::MAX_EMPTY);
+        } else {
+            sets.push_back(arg);
+        }
+    }
+
+    solver::init(solver::memory_budget(argc, argv), solver::table_file(argc, argv));
+    if (!generate_dir.empty()) return generate(generate_dir, count, seed);
+
+    std::vector<set_result> results;
+    for (const auto &file_name : sets) {
+        results.push_back(run_set(file_name, warm, weak));
+        const auto &r = results.back();
+        std::fprintf(stderr, "%-12s %5zu pos  mean %10.1f us  p99 %10.1f us  %12.0f nodes/s  %s\n",
+                     r.name.c_str(), r.positions, r.mean_us, r.p99_us,
+                     r.seconds > 0 ? r.stats.nodes / r.seconds : 0.0,
+                     r.mismatches ? "MISMATCH" : "ok");
+    }
+
+    FILE *out = json_file.empty() ? stdout : std::fopen(json_file.c_str(), "w");
+    if (!out) {
+        std::cerr << "failed to open " << json_file << '\n';
+        return 1;
+    }
+
+    std::fprintf(out, "{\n  \"table_mb\": %zu,\n  \"helpers\": %d,\n  \"warm\": %s,\n  \"weak\": %s,\n  \"history\": %s,\n  \"etc\": %s,\n  \"sets\": [",
+                 solver::memo.size() >> 20, solver::helpers, warm ? "true" : "false", weak ? "true" : "false",
+                 solver::history_ordering ? "true" : "false", solver::enhanced_cutoffs ? "true" : "false");
+    for (size_t i = 0; i < results.size(); i++) {
+        const auto &r = results[i];
+        std::fprintf(out, "%s\n    {\"name\": \"%s\", \"positions\": %zu, \"mismatches\": %zu, "
+                          "\"mean_us\": %.1f, \"p50_us\": %.1f, \"p99_us\": %.1f, "
+                          "\"nodes\": %llu, \"nodes_per_sec\": %.0f, \"tt_hit_rate\": %.4f, "
+                          "\"tt_stores\": %llu, \"tt_overwrites\": %llu, \"tt_collisions\": %llu, "
+                          "\"book_hits\": %llu, \"cutoffs\": %llu, \"first_cutoff_rate\": %.4f, \"etc_cutoffs\": %llu}",
+                     i ? "," : "", r.name.c_str(), r.positions, r.mismatches,
+                     r.mean_us, r.p50_us, r.p99_us, (unsigned long long)r.stats.nodes,
+                     r.seconds > 0 ? r.stats.nodes / r.seconds : 0.0, r.stats.hit_rate(),
+                     (unsigned long long)r.stats.stores, (unsigned long long)r.stats.overwrites,
+                     (unsigned long long)r.stats.collisions, (unsigned long long)r.stats.book_hits,
+                     (unsigned long long)r.stats.cutoffs, r.stats.first_cutoff_rate(),
+                     (unsigned long long)r.stats.etc_cutoffs);
+    }
+
+    std::fprintf(out, "\n  ]\n}\n");
+    if (out != stdout) std::fclose(out);
+
+    for (const auto &r : results) {
+        if (r.mismatches) return 1;
+    }
+}
@@ -0,0 +1,106 @@
+#pragma once
+
+#include <array>
+#include <cstdint>
+#include <utility>
+#include "position.hpp"
+
+/**
+ * Solver for the last few empty cells. Works on the raw board/flip pair
+ * with no table, no book and no move sorting: there are so few nodes
+ * below this point that probing and sorting cost more than they save.
+ *
+ * Every remaining depth is its own instantiation, so the recursion and
+ * the column loop unroll completely.
+ */
+namespace endgame {
+    using pos_t = position::pos_t;
+
+    // deepest endgame solve() can be asked for
+    static constexpr int MAX_EMPTY = 16;
+
+    // column masks, center first
+    static constexpr std::array<pos_t, position::WIDTH> COLUMN_ORDER = [] {
+        std::array<pos_t, position::WIDTH> res{};
+        // the reverse of edges first: 0, W - 1, 1, W - 2, ...
+        for (int i = 0; i < position::WIDTH; i++) {
+            int col = i % 2 ? position::WIDTH - 1 - i / 2 : i / 2;
+            res[position::WIDTH - 1 - i] = position::column_mask(col);
+        }
+
+        return res;
+    }();
+
+    /**
+     * Same contract as solver::negamax, for a position with EMPTY empty
+     * cells given as board/flip and position::wins/opponent_wins.
+     *
+     * @param nodes: incremented for every node visited
+     */
+    template <int EMPTY>
+    int negamax(pos_t board, pos_t flip, pos_t wins, pos_t opponent_wins, int alpha, int beta, uint64_t &nodes) {
+        nodes++;
+
+        pos_t possible = (flip + position::bottom_mask) & position::board_mask;
+        pos_t opponent_win = opponent_wins & (position::board_mask ^ flip);
+        pos_t valid = possible;
+        if (pos_t forced = possible & opponent_win) {
+            if (forced & (forced - 1)) return -EMPTY / 2;
+            valid = forced;
+        }
+
+        valid &= ~(opponent_win >> 1);
+        if (!valid) return -EMPTY / 2;
+
+        if (possible & wins) {
+            return (EMPTY + 1) / 2;
+        }
+
+        if constexpr (EMPTY <= 2) {
+            return 0;
+        } else {
+            // neither side can win right away
+            int min = -(EMPTY - 2) / 2;
+            int max = (EMPTY - 1) / 2;
+            if (alpha < min) {
+                alpha = min;
+                if (alpha >= beta) return alpha;
+            }
+
+            if (max < beta) {
+                beta = max;
+                if (alpha >= beta) return beta;
+            }
+
+            for (pos_t column : COLUMN_ORDER) {
+                pos_t move = valid & column;
+                if (!move) continue;
+
+                pos_t our_wins = position::compute_winning_position(board | move, 0);
+                int calc = -negamax<EMPTY - 1>(board ^ flip, flip | move, opponent_wins, our_wins, -beta, -alpha, nodes);
+                if (calc >= beta) return calc;
+                if (calc > alpha) alpha = calc;
+            }
+
+            return alpha;
+        }
+    }
+
+    using entry_t = int (*)(pos_t, pos_t, pos_t, pos_t, int, int, uint64_t&);
+
+    template <size_t... EMPTY>
+    constexpr std::array<entry_t, sizeof...(EMPTY)> make_entries(std::index_sequence<EMPTY...>) {
+        return {&negamax<int(EMPTY)>...};
+    }
+
+    // ENTRIES[e] solves a position with e empty cells
+    static constexpr auto ENTRIES = make_entries(std::make_index_sequence<MAX_EMPTY + 1>{});
+
+    /**
+     * @param cur: position with at most MAX_EMPTY empty cells
+     */
+    inline int solve(const position &cur, int alpha, int beta, uint64_t &nodes) {
+        return ENTRIES[position::WIDTH * position::HEIGHT - cur.moves](cur.board, cur.flip, cur.wins, cur.opponent_wins,
+                                                                   alpha, beta, nodes);
+    }
+};
@@ -2,6 +2,7 @@
 #include "thread_pool.hpp"
 #include <map>
 #include <unordered_set>
+#include <unordered_map>
 #include <fstream>
 #include <filesystem>
 #include <vector>
@@ -10,14 +11,14 @@
 #include <chrono>
 
 std::vector<position> generate_positions(int depth) {
-    std::unordered_set<position::pos_t> seen;
+    std::unordered_set<uint64_t> seen;
     std::vector<position> positions;
 
     const auto dfs = [&](const position &cur, int dep, auto &&self) -> void {
         if (cur.has_winning_move() || !cur.non_losing_moves()) return;
 
         if (dep == 0) {
-            auto key = cur.to_b3();
+            auto key = cur.book_key();
             if (!seen.count(key)) {
                 seen.insert(key);
                 positions.push_back(cur);
@@ -40,42 +41,213 @@ std::vector<position> generate_positions(int depth) {
     return positions;
 }
 
-int main() {
-    constexpr int DEPTH = 8;
-    const std::string FILE_PATH = "8-ply.bin";
-    
+using book_map = std::unordered_map<uint64_t, uint8_t>;
+
+/**
+ * The journal is an append-only log of packed (key, score) records, one
+ * per solved position, so a killed run can pick up where it stopped.
+ * A record cut off by the kill is ignored.
+ *
+ * @param length set to the bytes up to the end of the last whole record,
+ *               the journal has to be cut back to this before appending
+ */
+book_map load_journal(const std::string &file_name, uintmax_t &length) {
+    book_map done;
+    length = 0;
+    std::ifstream fin(file_name, std::ios::binary);
+    if (!fin) return done;
+
+    uint64_t key;
+    uint8_t score;
+    while (fin.read(reinterpret_cast<char*>(&key), sizeof(key))
+        && fin.read(reinterpret_cast<char*>(&score), sizeof(score))) {
+        done[key] = score;
+        length += sizeof(key) + sizeof(score);
+    }
+
+    return done;
+}
+
+/**
+ * Scores cur from its children, all of which are either decided on the
+ * spot or already solved in the layer below.
+ */
+int lookahead(const position &cur, const book_map &done) {
+    int best = -position::WIN;
+    for (int i = 0; i < position::WIDTH; i++) {
+        if (!cur.can_play(i)) continue;
+
+        position nxt = cur;
+        nxt.play_col(i);
+
+        int score;
+        if (nxt.has_winning_move()) {
+            score = (position::WIDTH * position::HEIGHT + 1 - nxt.moves) / 2;
+        } else if (!nxt.non_losing_moves()) {
+            score = -(position::WIDTH * position::HEIGHT - nxt.moves) / 2;
+        } else if (auto it = done.find(nxt.book_key()); it != done.end()) {
+            score = it->second - position::WIN;
+        } else {
+            score = solver::solve(nxt, false);
+        }
+
+        best = std::max(best, -score);
+    }
+
+    return best;
+}
+
+/**
+ * @return which of the shards the position with this book key belongs to
+ */
+size_t shard_of(uint64_t key, size_t shards) {
+    return custom_hash::splitmix64(key) % shards;
+}
+
+/**
+ * usage: gen [--depth N] [--table-mb MB] [--table-file PATH] [--shard I/K] [--merge FILE...]
+ *
+ *  --shard I/K: only solve shard I (0 based) of the K shards of the deepest
+ *               layer, into <N>-ply.shard-I-of-K.bin. Each shard can run
+ *               as its own process on its own machine.
+ *  --merge:     start from finished shard files, solve whatever they are
+ *               missing, then build the layers above as usual. A shard
+ *               file that is missing, empty, built for another depth or
+ *               with old keys is an error
+ */
+int main(int argc, char **argv) {
+    int DEPTH = 8;
+    size_t shard = 0, shards = 1;
+    std::vector<std::string> merge;
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--depth" && i + 1 < argc) {
+            DEPTH = std::stoi(argv[++i]);
+        } else if (arg == "--shard" && i + 1 < argc) {
+            std::string spec = argv[++i];
+            shard = std::stoul(spec.substr(0, spec.find('/')));
+            shards = std::stoul(spec.substr(spec.find('/') + 1));
+            if (shard >= shards) {
+                std::cerr << "shard must be below the shard count" << '\n';
+                return 1;
+            }
+        } else if (arg == "--merge") {
+            while (i + 1 < argc && std::string(argv[i + 1]).rfind("--", 0) != 0) {
+                merge.push_back(argv[++i]);
+            }
+        }
+    }
+
+    const bool sharded = shards > 1;
+    const std::string FILE_PATH = std::to_string(DEPTH) + "-ply"
+        + (sharded ? ".shard-" + std::to_string(shard) + "-of-" + std::to_string(shards) : "") + ".bin";
+    // journals hold book keys, so one from another book version is never resumed
+    const std::string JOURNAL_PATH = FILE_PATH + ".v" + std::to_string(opening_book::VERSION) + ".journal";
+    constexpr size_t BATCH = 4096;
+
+    solver::init(solver::memory_budget(argc, argv), solver::table_file(argc, argv));
+
+    // positions are already solved in parallel, one per worker
+    solver::helpers = 0;
+
     auto start = std::chrono::steady_clock::now();
     thread_pool tasks{};
 
-    std::vector<std::pair<uint64_t, uint8_t>> results;
-
-    for (int d = DEPTH; d >= 0; d--) {
-        solver::book.load(FILE_PATH);
-        
-        auto positions = generate_positions(DEPTH);
-        std::vector<std::pair<uint64_t, std::future<int>>> pending(positions.size());
-        for (int i = 0; i < positions.size(); i++) {
-            auto key = positions[i].to_b3();
-            auto score = tasks.submit(solver::solve, positions[i], false);
-            pending[i] = {key, std::move(score)};
+    uintmax_t journal_length;
+    book_map done = load_journal(JOURNAL_PATH, journal_length);
+    if (!done.empty()) {
+        std::cout << "Resuming with " << done.size() << " solved positions" << '\n';
+    }
+
+    for (const auto &file_name : merge) {
+        // a missing shard would quietly leave a hole in the book
+        if (!std::ifstream(file_name)) {
+            std::cerr << "failed to read shard " << file_name << '\n';
+            return 1;
+        }
+
+        opening_book part(file_name);
+        if (part.count == 0) {
+            std::cerr << "shard " << file_name << " is empty" << '\n';
+            return 1;
+        }
+
+        if (part.MAX_DEPTH != DEPTH) {
+            std::cerr << "shard " << file_name << " was built for depth " << part.MAX_DEPTH << '\n';
+            return 1;
         }
 
-        for (auto &[key, score] : pending) {
-            uint8_t mapped = score.get() + position::WIN;
-            results.push_back({key, mapped});
+        if (part.old_keys) {
+            std::cerr << "shard " << file_name << " was built with old keys, rebuild it" << '\n';
+            return 1;
+        }
+
+        for (size_t i = 0; i < part.count; i++) {
+            done[part.keys[i]] = part.scores[i];
+        }
+
+        std::cout << "Merged " << part.count << " positions from " << file_name << '\n';
+    }
+
+    // drop a record cut off by a kill, or everything appended after it
+    // would be read back misaligned
+    if (std::filesystem::exists(JOURNAL_PATH)) {
+        std::filesystem::resize_file(JOURNAL_PATH, journal_length);
+    }
+
+    std::ofstream journal(JOURNAL_PATH, std::ios::binary | std::ios::app);
+    const auto record = [&](uint64_t key, int score) {
+        uint8_t mapped = score + position::WIN;
+        done[key] = mapped;
+        journal.write(reinterpret_cast<const char*>(&key), sizeof(key));
+        journal.write(reinterpret_cast<const char*>(&mapped), sizeof(mapped));
+    };
+
+    // the deepest layer is searched, every layer above it is one move
+    // away from a finished layer
+    // a shard only ever owns part of the deepest layer
+    for (int d = DEPTH; d >= (sharded ? DEPTH : 0); d--) {
+        std::vector<position> todo;
+        for (const auto &pos : generate_positions(d)) {
+            auto key = pos.book_key();
+            if (sharded && shard_of(key, shards) != shard) continue;
+            if (!done.count(key)) todo.push_back(pos);
         }
 
-        std::ofstream fout(FILE_PATH, std::ios::binary);
+        std::cout << "Layer " << d << ": " << todo.size() << " positions left" << '\n';
+
+        if (d == DEPTH) {
+            for (size_t from = 0; from < todo.size(); from += BATCH) {
+                size_t to = std::min(todo.size(), from + BATCH);
+                std::vector<int> scores(to - from);
+                tasks.submit_range(from, to, [&](size_t i) {
+                    scores[i - from] = solver::solve(todo[i], false);
+                }).get();
+
+                for (size_t i = from; i < to; i++) {
+                    record(todo[i].book_key(), scores[i - from]);
+                }
 
-        size_t size = results.size();
-        fout.write(reinterpret_cast<const char*>(&size), sizeof(size));
-        for (auto &[key, score] : results) {
-            fout.write(reinterpret_cast<const char*>(&key), sizeof(key));
-            fout.write(reinterpret_cast<const char*>(&score), sizeof(score));
+                journal.flush();
+            }
+        } else {
+            for (const auto &pos : todo) {
+                record(pos.book_key(), lookahead(pos, done));
+            }
+
+            journal.flush();
         }
+
+        // replace the book only once the new one is complete
+        std::vector<std::pair<uint64_t, uint8_t>> results(done.begin(), done.end());
+        opening_book::save(FILE_PATH + ".tmp", results, DEPTH);
+        std::filesystem::rename(FILE_PATH + ".tmp", FILE_PATH);
     }
 
+    journal.close();
+    std::filesystem::remove(JOURNAL_PATH);
+
     auto end = std::chrono::steady_clock::now();
     std::chrono::duration<double> duration_seconds = end - start;
     std::cout << "Time elapsed: " << duration_seconds.count() << " seconds" << '\n';
-}
\ No newline at end of file
+}
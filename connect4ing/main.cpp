@@ -31,18 +31,124 @@ void clear_screen() {
     std::cout << "\033[2J\033[H";
 }
 
-int main() {
+/**
+ * Solves the AI's answers to every reply the human could make, in the
+ * background while they think. Replies are searched center first, the
+ * same guess the move ordering makes, and everything found lands in the
+ * table either way.
+ */
+struct ponder {
+    static constexpr int PENDING = INVALID_MOVE - 1;
+
+    std::stop_source stop;
+    std::atomic<int> running = 0;
+
+    // scores[reply][col]: the score of playing col after reply,
+    // PENDING until it is solved
+    std::array<std::array<int, position::WIDTH>, position::WIDTH> scores;
+
+    ponder(const position &cur, bool weak) {
+        for (auto &row : scores) row.fill(PENDING);
+
+        // workers run the newest task they have first, so the least
+        // likely replies go in first
+        for (int i = 0; i < position::WIDTH; i++) {
+            int reply = ORDER[i];
+            if (!cur.can_play(reply) || cur.is_winning_move(reply)) continue;
+
+            position mid = cur;
+            mid.play_col(reply);
+            if (mid.moves == position::WIDTH * position::HEIGHT) continue;
+
+            for (int col = 0; col < position::WIDTH; col++) {
+                if (!mid.can_play(col)) {
+                    scores[reply][col] = INVALID_MOVE;
+                    continue;
+                }
+
+                if (mid.is_winning_move(col)) {
+                    scores[reply][col] = weak ? 1 : (position::WIDTH * position::HEIGHT + 1 - mid.moves) / 2;
+                    continue;
+                }
+
+                running++;
+                tasks.execute([this, mid, col, reply, weak] {
+                    if (!stop.stop_requested()) {
+                        position nxt = mid;
+                        nxt.play_col(col);
+                        outcome calc = solve(nxt, weak, limits{stop.get_token()});
+                        if (calc.finished()) scores[reply][col] = -calc.lower;
+                    }
+
+                    running--;
+                    running.notify_all();
+                });
+            }
+        }
+    }
+
+    // queued tasks still point at us
+    ~ponder() {
+        finish();
+    }
+
+    /**
+     * Stops every search that is still going and waits until they have.
+     */
+    void finish() {
+        stop.request_stop();
+        for (int left; (left = running.load()) != 0; ) {
+            running.wait(left);
+        }
+    }
+
+    /**
+     * @return the best column after reply, the first one on ties like
+     *         get_best_move(), -1 if it wasn't solved in time
+     */
+    int best_move(int reply) const {
+        const auto &res = scores[reply];
+        if (std::count(res.begin(), res.end(), PENDING)) return -1;
+
+        int best = 0;
+        for (int i = 1; i < position::WIDTH; i++) {
+            if (res[i] > res[best]) best = i;
+        }
+
+        return best;
+    }
+};
+
+int main(int argc, char **argv) {
+    solver::init(solver::memory_budget(argc, argv), solver::table_file(argc, argv));
     solver::book.load("8-ply.bin");
     position cur{};
     
     bool human_turn = false;
     bool weak = false;
 
+    bool pondering = false;
+
+    // --stats shows what the search counted for the last AI move, --weak
+    // makes the AI play any move that keeps the outcome instead of the
+    // fastest win or slowest loss, --ponder searches while you think
+    solver::search_stats last;
+    for (int i = 1; i < argc; i++) {
+        if (std::string(argv[i]) == "--stats") solver::collect_stats = true;
+        if (std::string(argv[i]) == "--weak") weak = true;
+        if (std::string(argv[i]) == "--ponder") pondering = true;
+    }
+
+    std::unique_ptr<ponder> thinking;
+    int reply = -1;
+
     while (true) {
         clear_screen();
         print_header();
         print_board(cur);
         std::cout << "\n";
+        if (solver::collect_stats && cur.moves > 0) std::cout << last << "\n\n";
+
         // terminal state checks
         if (cur.has_winning_move()) {
             std::cout << (human_turn ? "AI wins!\n" : "You win!\n");
@@ -55,8 +161,10 @@ int main() {
         }
 
         if (human_turn) {
+            if (pondering && !thinking) thinking = std::make_unique<ponder>(cur, weak);
+
             int col;
-            std::cout << "Your move (1-7): ";
+            std::cout << "Your move (1-" << position::WIDTH << "): ";
             std::cin >> col;
             col--;
 
@@ -71,11 +179,27 @@ int main() {
 
             cur.play_col(col);
             human_turn = false;
+            reply = col;
         } else {
             std::cout << "AI thinking...\n";
-            int ai_move = solver::get_best_move(cur, weak);
+            last = {};
+
+            int ai_move = -1;
+            if (thinking) {
+                thinking->finish();
+                ai_move = thinking->best_move(reply);
+                thinking.reset();
+            }
+
+            // whatever pondering did solve is still in the table
+            if (ai_move < 0) ai_move = solver::get_best_move(cur, weak, {}, &last);
+
             cur.play_col(ai_move);
             human_turn = true;
+
+            // the next move searches in a new generation, so entries from
+            // earlier in the game are evicted first
+            solver::memo.next_generation();
         }
     }
 
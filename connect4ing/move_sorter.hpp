@@ -1,15 +1,16 @@
 #include "position.hpp"
 #include <cstdint>
 
-struct move_sorter {
+template <typename P>
+struct basic_move_sorter {
     struct {
-        position::pos_t move;
+        typename P::pos_t move;
         int score;
-    } entries[position::WIDTH];
+    } entries[P::WIDTH];
     
     int size = 0;
 
-    void add(position::pos_t move, int score) {
+    void add(typename P::pos_t move, int score) {
         int loc = size++;
         for (; loc && entries[loc - 1].score > score; loc--) {
             entries[loc] = entries[loc - 1];
@@ -19,8 +20,78 @@ struct move_sorter {
         entries[loc].score = score;
     }
 
-    position::pos_t get_next() {
+    typename P::pos_t get_next() {
         if (size == 0) return 0;
         return entries[--size].move;
     }
-};
\ No newline at end of file
+};
+
+using move_sorter = basic_move_sorter<position>;
+
+/**
+ * History heuristic, breaks ties between moves that make the same number
+ * of threats. Every (player, cell) starts with a bonus for being close to
+ * the center. When a move fails high, the moves tried before it each lose
+ * a point and it gains one per move it had to wait for.
+ */
+template <typename P>
+struct basic_move_history {
+    using pos_t = typename P::pos_t;
+    static constexpr int CELLS = P::WIDTH * (P::HEIGHT + 1);
+
+    // threats always decide first, history only orders within them
+    static constexpr int THREAT_SCALE = 1 << 20;
+    static constexpr int LIMIT = 1 << 18;
+    static constexpr int CENTER_BONUS = 32;
+
+    int history[2][CELLS];
+
+    basic_move_history() {
+        clear();
+    }
+
+    void clear() {
+        for (auto &side : history) {
+            for (int col = 0; col < P::WIDTH; col++) {
+                int from_center = col < P::WIDTH / 2 ? P::WIDTH / 2 - col : col - P::WIDTH / 2;
+                for (int row = 0; row <= P::HEIGHT; row++) {
+                    side[col * (P::HEIGHT + 1) + row] = CENTER_BONUS * (P::WIDTH / 2 - from_center);
+                }
+            }
+        }
+    }
+
+    /**
+     * @param move: bitmap of the cell played
+     * @param threats: what position::get_score() says about move
+     */
+    int score(const P &cur, pos_t move, int threats) const {
+        return threats * THREAT_SCALE + history[cur.moves & 1][P::ctz(move)];
+    }
+
+    /**
+     * Records that the last of tried failed high at cur.
+     *
+     * @param tried: moves searched at cur, in order
+     */
+    void cutoff(const P &cur, const pos_t *tried, int count) {
+        auto &side = history[cur.moves & 1];
+        for (int i = 0; i < count - 1; i++) side[P::ctz(tried[i])]--;
+
+        int &h = side[P::ctz(tried[count - 1])];
+        h += count - 1;
+
+        // points only move around, but single cells can still run off
+        if (h > LIMIT) {
+            for (int &x : side) x /= 2;
+        }
+
+        for (int i = 0; i < count - 1; i++) {
+            if (side[P::ctz(tried[i])] < -LIMIT) {
+                for (int &x : side) x /= 2;
+            }
+        }
+    }
+};
+
+using move_history = basic_move_history<position>;
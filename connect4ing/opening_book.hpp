@@ -4,49 +4,210 @@
 #include <iostream>
 #include <unordered_map>
 #include <optional>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 #include "position.hpp"
 #include "hash.hpp"
 
-struct opening_book {
-    const int MAX_DEPTH = 8;
-    std::vector<uint8_t> scores;
+/**
+ * Book file layout (little endian, everything 8 byte aligned):
+ *  header
+ *  uint64_t keys[count]   sorted book_key() keys (to_b3() before version 2)
+ *  uint8_t scores[count]  score + P::WIN for keys[i]
+ *
+ * The file is mapped read only and searched in place, so loading costs
+ * nothing and only the pages we touch become resident.
+ */
+template <typename P>
+struct basic_opening_book {
+    static constexpr char MAGIC[8] = {'C', '4', 'B', 'O', 'O', 'K', 0, 0};
+    static constexpr uint32_t VERSION = 2;
 
-    opening_book() = default;
+    struct header {
+        char magic[8];
+        uint32_t version;
+        uint8_t width;
+        uint8_t height;
+        uint8_t depth;
+        uint8_t pad;
+        uint64_t count;
+    };
 
-    opening_book(const std::string &file_name) {
+    int MAX_DEPTH = 8;
+
+    const uint64_t *keys = nullptr;
+    const uint8_t *scores = nullptr;
+    size_t count = 0;
+
+    // keys are to_b3() keys from an older book, on boards where those
+    // differ from book_key()
+    bool old_keys = false;
+
+    void *region = nullptr;
+    size_t region_size = 0;
+
+    // books in the old (size, key, score...) format are read into these
+    std::vector<uint64_t> legacy_keys;
+    std::vector<uint8_t> legacy_scores;
+
+    basic_opening_book() = default;
+
+    basic_opening_book(const std::string &file_name) {
         load(file_name);
     }
 
+    basic_opening_book(const basic_opening_book&) = delete;
+    basic_opening_book& operator=(const basic_opening_book&) = delete;
+
+    ~basic_opening_book() {
+        release();
+    }
+
+    void release() {
+        if (region) munmap(region, region_size);
+        region = nullptr;
+        region_size = 0;
+        keys = nullptr;
+        scores = nullptr;
+        count = 0;
+        old_keys = false;
+        legacy_keys.clear();
+        legacy_scores.clear();
+    }
+
+    /**
+     * Maps the book at file_name, or leaves the book empty if there is no
+     * such file.
+     *
+     * @throws std::runtime_error if the file can't be read or isn't a book
+     *         for this board
+     */
     void load(const std::string &file_name) {
-        scores.clear();
+        release();
         if (!std::filesystem::exists(file_name)) return;
 
-        std::ifstream fin(file_name, std::ios::binary);
-        assert(fin && "failed to open file");
+        int fd = open(file_name.c_str(), O_RDONLY);
+        if (fd < 0) throw std::runtime_error("failed to open " + file_name);
+
+        const auto fail = [&](const std::string &why) {
+            close(fd);
+            throw std::runtime_error(why + ": " + file_name);
+        };
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) fail("failed to stat");
+        size_t size = st.st_size;
+
+        header head{};
+        if (size >= sizeof(head) && pread(fd, &head, sizeof(head), 0) != sizeof(head)) fail("failed to read");
+        if (size < sizeof(head) || std::memcmp(head.magic, MAGIC, sizeof(MAGIC)) != 0) {
+            close(fd);
+            load_legacy(file_name);
+            return;
+        }
+
+        if (head.version > VERSION) fail("unsupported book version");
+        if (head.width != P::WIDTH || head.height != P::HEIGHT) fail("book is for another board");
+        if (head.count > (size - sizeof(head)) / (sizeof(uint64_t) + 1)) fail("truncated book");
+
+        region = mmap(nullptr, size, PROT_READ, MAP_SHARED, fd, 0);
+        if (region == MAP_FAILED) {
+            region = nullptr;
+            fail("failed to map");
+        }
+
+        close(fd);
+        region_size = size;
+
+        const char *base = static_cast<const char*>(region);
+        MAX_DEPTH = head.depth;
+        count = head.count;
+        old_keys = head.version < 2 && sizeof(typename P::pos_t) == sizeof(uint64_t);
+        keys = reinterpret_cast<const uint64_t*>(base + sizeof(head));
+        scores = reinterpret_cast<const uint8_t*>(keys + count);
+    }
+
+    /**
+     * Reads a book written before the versioned format, which is just
+     * a size followed by packed (key, score) pairs.
+     *
+     * @throws std::runtime_error if the file is shorter than its size says
+     */
+    void load_legacy(const std::string &file_name) {
+        std::ifstream fin(file_name, std::ios::binary | std::ios::ate);
+        if (!fin) throw std::runtime_error("failed to open " + file_name);
+        size_t file_size = fin.tellg();
+        fin.seekg(0);
 
         size_t size = 0;
-        fin.read(reinterpret_cast<char*>(&size), sizeof(size));
-        std::vector<std::pair<uint64_t, uint8_t>> entries(size);
+        constexpr size_t RECORD = sizeof(uint64_t) + sizeof(uint8_t);
+        if (file_size < sizeof(size) || !fin.read(reinterpret_cast<char*>(&size), sizeof(size))
+         || size > (file_size - sizeof(size)) / RECORD) {
+            throw std::runtime_error("not a book: " + file_name);
+        }
 
-        uint64_t max_key = 0;
-        for (int i = 0; i < size; i++) {
-            uint64_t key;
-            uint8_t score;
-            fin.read(reinterpret_cast<char*>(&key), sizeof(key));
-            fin.read(reinterpret_cast<char*>(&score), sizeof(score));
-            entries[i] = {key, score};
-            if (key > max_key) max_key = key;
+        std::vector<char> raw(size * RECORD);
+        if (!fin.read(raw.data(), raw.size())) throw std::runtime_error("failed to read " + file_name);
+
+        std::vector<std::pair<uint64_t, uint8_t>> entries(size);
+        for (size_t i = 0; i < size; i++) {
+            std::memcpy(&entries[i].first, raw.data() + i * RECORD, sizeof(uint64_t));
+            entries[i].second = raw[i * RECORD + sizeof(uint64_t)];
         }
 
-        scores.resize(max_key + 1);
+        std::sort(entries.begin(), entries.end());
         for (const auto &[key, score] : entries) {
-            scores[key] = score;
+            legacy_keys.push_back(key);
+            legacy_scores.push_back(score);
         }
+
+        keys = legacy_keys.data();
+        scores = legacy_scores.data();
+        count = size;
+        old_keys = sizeof(typename P::pos_t) == sizeof(uint64_t);
+    }
+
+    /**
+     * Writes a book in the current format.
+     *
+     * @param entries: (book_key() key, score + P::WIN) pairs, any order
+     * @param depth: deepest ply stored in the book
+     */
+    static void save(const std::string &file_name, std::vector<std::pair<uint64_t, uint8_t>> entries, int depth) {
+        std::sort(entries.begin(), entries.end());
+
+        header head{};
+        std::memcpy(head.magic, MAGIC, sizeof(MAGIC));
+        head.version = VERSION;
+        head.width = P::WIDTH;
+        head.height = P::HEIGHT;
+        head.depth = depth;
+        head.count = entries.size();
+
+        std::vector<uint64_t> out_keys(entries.size());
+        std::vector<uint8_t> out_scores(entries.size());
+        for (size_t i = 0; i < entries.size(); i++) {
+            out_keys[i] = entries[i].first;
+            out_scores[i] = entries[i].second;
+        }
+
+        std::ofstream fout(file_name, std::ios::binary);
+        fout.write(reinterpret_cast<const char*>(&head), sizeof(head));
+        fout.write(reinterpret_cast<const char*>(out_keys.data()), out_keys.size() * sizeof(uint64_t));
+        fout.write(reinterpret_cast<const char*>(out_scores.data()), out_scores.size());
     }
 
-    int get_minimax(const position &cur) {
-        if (cur.moves > MAX_DEPTH) return 0;
-        auto hash = cur.to_b3();
-        return hash < scores.size() ? scores[hash] : 0;
+    int get_minimax(const P &cur) const {
+        if (cur.moves > MAX_DEPTH || count == 0) return 0;
+        auto hash = old_keys ? cur.to_b3() : cur.book_key();
+        auto it = std::lower_bound(keys, keys + count, hash);
+        return it != keys + count && *it == hash ? scores[it - keys] : 0;
     }
-};
\ No newline at end of file
+};
+
+using opening_book = basic_opening_book<position>;
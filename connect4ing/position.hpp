@@ -4,6 +4,9 @@
 #include <cassert>
 #include <string>
 #include <array>
+#include <algorithm>
+#include <type_traits>
+#include <optional>
 
 /**
  * store position w/ two integers
@@ -12,11 +15,24 @@
  * board: the board itself
  * 
  * when we play a move, we do the move then swap POVs
+ *
+ * the same two integers are also kept with the columns mirrored, so the
+ * key shared by a position and its mirror image is just a min
+ *
+ * both players' winning cells are kept up to date as moves are played, so
+ * the threat checks in the search are a single AND
+ *
+ * every column takes HEIGHT + 1 bits, boards that don't fit in 64 bits
+ * use 128 bit integers
  */
-struct position {
-    using pos_t = uint64_t;
-    static constexpr int WIDTH = 7;
-    static constexpr int HEIGHT = 6;
+template <int W, int H>
+struct basic_position {
+    static_assert(H >= 4 && W >= 4, "need room for four in a row");
+    static_assert(W * (H + 1) <= 128, "board doesn't fit in 128 bits");
+
+    using pos_t = std::conditional_t<W * (H + 1) <= 64, uint64_t, unsigned __int128>;
+    static constexpr int WIDTH = W;
+    static constexpr int HEIGHT = H;
     static constexpr int WIN = 1 + WIDTH * HEIGHT / 2;
     template<int width, int height> struct bottom {static constexpr pos_t mask = bottom<width - 1, height>::mask | pos_t(1) << (width - 1) * (height + 1);};
     template <int height> struct bottom<0, height> {static constexpr pos_t mask = 0;};
@@ -24,20 +40,33 @@ struct position {
     static constexpr pos_t bottom_mask = bottom<WIDTH, HEIGHT>::mask;
     static constexpr pos_t board_mask = bottom_mask * ((pos_t(1) << HEIGHT) - 1);
 
-    static constexpr std::array<int, 7> pow3 = {1, 3, 9, 27, 81, 243, 729};
+    static constexpr std::array<int, WIDTH> pow3 = [] {
+        std::array<int, WIDTH> res{};
+        for (int i = 0, p = 1; i < WIDTH; i++, p *= 3) res[i] = p;
+        return res;
+    }();
 
     // board = bitmap of all pieces current player has
     // flip  = all the currently played positions
     pos_t board = 0;
     pos_t flip = 0;
+    pos_t mirror_board = 0;
+    pos_t mirror_flip = 0;
+
+    // cells that would complete four for the player to move / the other
+    // player, filled ones included
+    pos_t wins = 0;
+    pos_t opponent_wins = 0;
     int moves = 0;
 
-    position() : board(0), flip(0), moves(0) {}
+    basic_position() : board(0), flip(0), moves(0) {}
 
-    position(pos_t _board, pos_t _flip, int _moves) 
-           : board(_board), flip(_flip), moves(_moves) {}
+    basic_position(pos_t _board, pos_t _flip, int _moves) 
+           : board(_board), flip(_flip), mirror_board(mirror(_board)), mirror_flip(mirror(_flip)),
+             wins(compute_winning_position(_board, 0)), opponent_wins(compute_winning_position(_board ^ _flip, 0)),
+             moves(_moves) {}
 
-    position(const std::string &seq) : board(0), flip(0), moves(0) {
+    basic_position(const std::string &seq) : board(0), flip(0), moves(0) {
         for (char c : seq) {
             int move = c - '1';
             assert(can_play(move));
@@ -45,8 +74,28 @@ struct position {
         }
     }
 
+    /**
+     * @param seq: moves as columns 1-WIDTH
+     * @return the position after seq, if every move is legal, nobody has
+     *         won along the way and the board isn't full
+     */
+    static std::optional<basic_position> parse(const std::string &seq) {
+        basic_position cur;
+        for (char c : seq) {
+            int col = c - '1';
+            if (col < 0 || col >= WIDTH || !cur.can_play(col) || cur.is_winning_move(col)) {
+                return std::nullopt;
+            }
+
+            cur.play_col(col);
+        }
+
+        if (cur.moves == WIDTH * HEIGHT) return std::nullopt;
+        return cur;
+    }
+
     void partial_key(uint64_t &key, int col) const {
-        for (uint64_t bit = uint64_t(1) << (col * (HEIGHT + 1)); bit & flip; bit <<= 1) {
+        for (pos_t bit = pos_t(1) << (col * (HEIGHT + 1)); bit & flip; bit <<= 1) {
             key *= 3;
             if (bit & board) key += 1;
             else key += 2;
@@ -72,6 +121,20 @@ struct position {
         return key_f < key_r ? key_f / 3 : key_r / 3;
     }
 
+    /**
+     * @return key shared by this position and its mirror image, for the
+     *         opening book. Boards that fit in 64 bits use canonical_key(),
+     *         which play() already keeps up to date, bigger ones fall back
+     *         to to_b3(), which fits for the first few dozen moves
+     */
+    uint64_t book_key() const {
+        if constexpr (sizeof(pos_t) == sizeof(uint64_t)) {
+            return canonical_key();
+        } else {
+            return to_b3();
+        }
+    }
+
     /**
      * @param col: the column we want to play in
      * @return if we can play in this column
@@ -87,10 +150,8 @@ struct position {
      * 
      * @param move: bitmap of the cell we place at.
      */
-    void play(uint64_t move) {
-        board ^= flip;
-        flip |= move;
-        moves++;
+    void play(pos_t move) {
+        play_cell(move, column_of(move));
     }
 
     /**
@@ -100,13 +161,27 @@ struct position {
      */
     void play_col(int col) {
         assert(can_play(col));
-        board ^= flip;
 
-        // to adjust mask, we use bit carryover
+        // to find the cell, we use bit carryover
         // 1111 + 0001 => 10000
-        // can just use bitwise OR
+        play_cell((flip + bottom_mask_col(col)) & column_mask(col), col);
+    }
+
+    /**
+     * @param move: bitmap of the cell we place at
+     * @param col: the column move is in
+     */
+    void play_cell(pos_t move, int col) {
+        // only our cells can change, the ones we just filled stay in
+        // the opponent's bitmap and get masked out when used
+        pos_t our_wins = compute_winning_position(board | move, 0);
+        wins = opponent_wins;
+        opponent_wins = our_wins;
 
-        flip |= flip + bottom_mask_col(col);
+        board ^= flip;
+        flip |= move;
+        mirror_board ^= mirror_flip;
+        mirror_flip |= mirror_cell(move, col);
         moves++;
     }
 
@@ -115,15 +190,14 @@ struct position {
      * @return if this move results in a win.
      */
     bool is_winning_move(int col) const {
-        pos_t upd = board | ((flip + bottom_mask_col(col)) & column_mask(col));
-        return alignment(upd);
+        return wins & (flip + bottom_mask_col(col)) & column_mask(col);
     }
 
     /**
      * @return if current player has a legal winning move.
      */
     bool has_winning_move() const {
-        return possible() & compute_winning_position(board, flip);
+        return possible() & wins;
     }
 
     /**
@@ -131,7 +205,7 @@ struct position {
      */
     pos_t non_losing_moves() const {
         pos_t possible_mask = possible();
-        pos_t opponent_win = compute_winning_position(board ^ flip, flip);
+        pos_t opponent_win = opponent_wins & (board_mask ^ flip);
         pos_t forced_moves = possible_mask & opponent_win;
         if (forced_moves) {
             if (forced_moves & (forced_moves - 1)) {
@@ -159,21 +233,43 @@ struct position {
         return board + flip;
     }
 
+    /**
+     * @return key of this position with the columns mirrored
+     */
+    pos_t mirror_key() const {
+        return mirror_board + mirror_flip;
+    }
+
+    /**
+     * @return key shared by this position and its mirror image
+     */
+    pos_t canonical_key() const {
+        return std::min(key(), mirror_key());
+    }
+
+    /**
+     * @return if canonical_key() is the key of the mirror image, so any
+     *         column stored under it has to be flipped back
+     */
+    bool is_mirrored() const {
+        return mirror_key() < key();
+    }
+
     /**
      * @return winning cells for this position
      */
     pos_t get_winning() const {
-        return compute_winning_position(board, flip);
+        return wins & (board_mask ^ flip);
     }
 
     /** 
      * @param move: bitmap of the move we want to play
      * @return how many "winning" cells are created after playing col
      */
-    int get_score(uint64_t move) const {
+    int get_score(pos_t move) const {
         pos_t upd_board = board | move;
         pos_t upd_flip = flip | move;
-        return __builtin_popcountll(compute_winning_position(upd_board, upd_flip));
+        return popcount(compute_winning_position(upd_board, upd_flip));
     }
 
     /**
@@ -200,6 +296,57 @@ struct position {
         return ((pos_t(1) << HEIGHT) - 1) << (col * (HEIGHT + 1));
     }
 
+    /**
+     * @return index of the lowest set bit of a non-empty bitmap
+     */
+    static constexpr int ctz(pos_t bits) {
+        if constexpr (sizeof(pos_t) > sizeof(uint64_t)) {
+            uint64_t low = uint64_t(bits);
+            return low ? __builtin_ctzll(low) : 64 + __builtin_ctzll(uint64_t(bits >> 64));
+        } else {
+            return __builtin_ctzll(bits);
+        }
+    }
+
+    static constexpr int popcount(pos_t bits) {
+        if constexpr (sizeof(pos_t) > sizeof(uint64_t)) {
+            return __builtin_popcountll(uint64_t(bits)) + __builtin_popcountll(uint64_t(bits >> 64));
+        } else {
+            return __builtin_popcountll(bits);
+        }
+    }
+
+    /**
+     * @param move: bitmap of a single cell
+     * @return the column the cell is in
+     */
+    static constexpr int column_of(pos_t move) {
+        return ctz(move) / (HEIGHT + 1);
+    }
+
+    /**
+     * @param move: bitmap of a single cell
+     * @param col: the column the cell is in
+     * @return the same cell in the mirrored column
+     */
+    static constexpr pos_t mirror_cell(pos_t move, int col) {
+        int shift = (WIDTH - 1 - 2 * col) * (HEIGHT + 1);
+        return shift >= 0 ? move << shift : move >> -shift;
+    }
+
+    /**
+     * @param pos: any bitmap of the board
+     * @return the bitmap with its columns mirrored
+     */
+    static constexpr pos_t mirror(pos_t pos) {
+        pos_t res = 0;
+        for (int col = 0; col < WIDTH; col++) {
+            res |= mirror_cell(pos & (column_mask(col) | top_mask_col(col) << 1), col);
+        }
+
+        return res;
+    }
+
     /**
      * @param pos: the bitmap of the current player's tiles
      * @return if there exists a 4 in a row here
@@ -228,11 +375,25 @@ struct position {
      * @return all unfilled slots resulting in a win for current side
      */
     static pos_t compute_winning_position(pos_t position, pos_t mask) {
+        pos_t r;
+        winning_cells(position, mask, r);
+        return r;
+    }
+
+    /**
+     * compute_winning_position() for any T that has the bitwise operators,
+     * including GCC vector types, so several boards can be done at once.
+     * Vectors only go through references so no vector ABI is involved.
+     *
+     * @param r: filled with the winning cells
+     */
+    template <typename T>
+    [[gnu::always_inline]] static inline void winning_cells(const T &position, const T &mask, T &r) {
         // vertical
-        pos_t r = (position << 1) & (position << 2) & (position << 3);
+        r = (position << 1) & (position << 2) & (position << 3);
 
         // horizontal
-        pos_t p = (position << (HEIGHT + 1)) & (position << 2 * (HEIGHT + 1));
+        T p = (position << (HEIGHT + 1)) & (position << 2 * (HEIGHT + 1));
         r |= p & (position << 3 * (HEIGHT + 1));
         r |= p & (position >> (HEIGHT + 1));
         p = (position >> (HEIGHT + 1)) & (position >> 2 * (HEIGHT + 1));
@@ -255,6 +416,17 @@ struct position {
         r |= p & (position << (HEIGHT + 2));
         r |= p & (position >> 3 * (HEIGHT + 2));
 
-        return r & (board_mask ^ mask);
+        r &= board_mask ^ mask;
     }
-};
\ No newline at end of file
+};
+
+#ifndef CONNECT4_WIDTH
+#define CONNECT4_WIDTH 7
+#endif
+
+#ifndef CONNECT4_HEIGHT
+#define CONNECT4_HEIGHT 6
+#endif
+
+// the board every executable is built for, e.g. -DCONNECT4_WIDTH=9 -DCONNECT4_HEIGHT=7
+using position = basic_position<CONNECT4_WIDTH, CONNECT4_HEIGHT>;
@@ -0,0 +1,359 @@
+#include "solver.cpp"
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <csignal>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <unordered_set>
+#include <vector>
+#include <sys/socket.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+/**
+ * usage: server [--socket PATH] [--weak] [--book FILE] [--table-mb MB] [--table-file PATH]
+ *
+ * Loads the book and the table once and answers requests until stdin
+ * closes, or with --socket until SIGINT or SIGTERM, where every client that
+ * connects to the Unix socket at PATH gets the same protocol. On a signal
+ * the server stops reading, answers every request it has read and exits
+ * normally, so a --table-file is flushed. One request per line:
+ *
+ *   solve MOVES      ->  solve MOVES <score> <micros>
+ *   bestmove MOVES   ->  bestmove MOVES <column> <score> <micros>
+ *   analyze MOVES    ->  analyze MOVES <score per column, x if full> <micros>
+ *   stats            ->  stats <requests> <mean> <p50> <p99> <max micros>
+ *
+ * MOVES is a move string (1-WIDTH) and may be empty for the empty board.
+ * Requests run in parallel on the solver's workers, so answers come back
+ * in the order they finish; every answer starts with the request it
+ * belongs to. micros is the time from reading the request to writing the
+ * answer, queueing included. A request that can't be answered gets
+ * "<request> error <reason>".
+ */
+
+// how many of the most recent requests stats covers
+static constexpr size_t LATENCY_WINDOW = 1 << 16;
+
+/**
+ * Latencies of the last LATENCY_WINDOW requests, shared by every client.
+ */
+struct latencies {
+    std::mutex lock;
+    std::vector<int64_t> micros;
+    size_t next = 0;
+    uint64_t requests = 0;
+
+    void add(int64_t value) {
+        std::lock_guard guard(lock);
+        if (micros.size() < LATENCY_WINDOW) {
+            micros.push_back(value);
+        } else {
+            micros[next] = value;
+            next = (next + 1) % LATENCY_WINDOW;
+        }
+
+        requests++;
+    }
+
+    std::string summary() {
+        std::vector<int64_t> sorted;
+        uint64_t count;
+        {
+            std::lock_guard guard(lock);
+            sorted = micros;
+            count = requests;
+        }
+
+        if (sorted.empty()) return "0 0 0 0 0";
+        std::sort(sorted.begin(), sorted.end());
+
+        int64_t sum = 0;
+        for (int64_t t : sorted) sum += t;
+
+        std::ostringstream out;
+        out << count << ' ' << sum / int64_t(sorted.size())
+            << ' ' << sorted[sorted.size() / 2]
+            << ' ' << sorted[std::min(sorted.size() - 1, sorted.size() * 99 / 100)]
+            << ' ' << sorted.back();
+        return out.str();
+    }
+};
+
+latencies recorded;
+bool weak = false;
+
+/**
+ * Where answers for one client go. Writes from different workers are
+ * serialized, and in_flight lets the reader wait for every answer before
+ * it lets go of the client.
+ */
+struct client {
+    int fd;
+    std::mutex lock;
+    std::atomic<int> in_flight = 0;
+
+    explicit client(int _fd) : fd(_fd) {}
+
+    void send_line(const std::string &line) {
+        std::lock_guard guard(lock);
+        if (fd == STDIN_FILENO) {
+            std::cout << line << '\n' << std::flush;
+            return;
+        }
+
+        std::string data = line + '\n';
+        for (size_t sent = 0; sent < data.size(); ) {
+            ssize_t n = send(fd, data.data() + sent, data.size() - sent, MSG_NOSIGNAL);
+            if (n <= 0) return;
+            sent += n;
+        }
+    }
+
+    void wait_idle() {
+        for (int left; (left = in_flight.load()) != 0; ) {
+            in_flight.wait(left);
+        }
+    }
+};
+
+/**
+ * Scores of every column on this thread only, solver::analyze() would
+ * wait on other workers from inside a worker.
+ */
+std::array<int, position::WIDTH> analyze_here(const position &cur) {
+    std::array<int, position::WIDTH> res;
+    for (int i = 0; i < position::WIDTH; i++) {
+        if (!cur.can_play(i)) {
+            res[i] = solver::INVALID_MOVE;
+        } else if (cur.is_winning_move(i)) {
+            res[i] = weak ? 1 : (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2;
+        } else {
+            position nxt = cur;
+            nxt.play_col(i);
+            res[i] = -solver::solve(nxt, weak);
+        }
+    }
+
+    return res;
+}
+
+struct reply {
+    std::string text;
+
+    // only answered requests count towards the latencies
+    bool timed = false;
+};
+
+/**
+ * @return the answer to one request line, without the timing
+ */
+reply answer(const std::string &line) {
+    std::istringstream in(line);
+    std::string command, moves, extra;
+    in >> command >> moves >> extra;
+    if (!extra.empty()) return {line + " error too many arguments"};
+
+    if (command == "stats") return {line + ' ' + recorded.summary()};
+    if (command != "solve" && command != "bestmove" && command != "analyze") {
+        return {line + " error unknown command"};
+    }
+
+    auto cur = position::parse(moves);
+    if (!cur) return {line + " error invalid position"};
+
+    // every request is its own search as far as replacement goes
+    solver::memo.next_generation();
+
+    std::ostringstream out;
+    out << line;
+    if (command == "solve") {
+        out << ' ' << solver::solve(*cur, weak);
+    } else if (command == "bestmove") {
+        auto [col, score] = solver::score_and_move(*cur, weak);
+        out << ' ' << col + 1 << ' ' << score;
+    } else {
+        for (int score : analyze_here(*cur)) {
+            if (score == solver::INVALID_MOVE) out << " x";
+            else out << ' ' << score;
+        }
+    }
+
+    return {out.str(), true};
+}
+
+struct request {
+    std::shared_ptr<client> from;
+    std::string line;
+    std::chrono::steady_clock::time_point received;
+};
+
+// workers run their newest task first, so every task answers the oldest
+// request here instead of the one it was made for, to keep the queue fair
+std::mutex queue_lock;
+std::deque<request> queue;
+
+/**
+ * Hands a request to the workers, the answer goes back to who asked.
+ */
+void submit(const std::shared_ptr<client> &from, std::string line) {
+    from->in_flight++;
+    {
+        std::lock_guard guard(queue_lock);
+        queue.push_back({from, std::move(line), std::chrono::steady_clock::now()});
+    }
+
+    solver::tasks.execute([] {
+        request req;
+        {
+            std::lock_guard guard(queue_lock);
+            req = std::move(queue.front());
+            queue.pop_front();
+        }
+
+        reply res = answer(req.line);
+        if (res.timed) {
+            auto micros = std::chrono::duration_cast<std::chrono::microseconds>(
+                std::chrono::steady_clock::now() - req.received).count();
+            recorded.add(micros);
+            res.text += ' ' + std::to_string(micros);
+        }
+
+        req.from->send_line(res.text);
+        req.from->in_flight--;
+        req.from->in_flight.notify_all();
+    });
+}
+
+// sockets of the connected clients, so shutting down can stop reading
+// from them
+std::mutex clients_lock;
+std::unordered_set<int> open_clients;
+std::atomic<int> live_clients = 0;
+
+int listener = -1;
+volatile std::sig_atomic_t quitting = 0;
+
+/**
+ * SIGINT and SIGTERM handler, shutting the listener down wakes accept().
+ */
+extern "C" void on_quit(int) {
+    quitting = 1;
+    shutdown(listener, SHUT_RDWR);
+}
+
+/**
+ * Reads requests from one socket client until it disconnects or the server
+ * shuts down, then waits for its answers before closing it.
+ */
+void serve_client(int fd) {
+    auto to = std::make_shared<client>(fd);
+    std::string pending;
+    char buffer[4096];
+    for (ssize_t n; (n = read(fd, buffer, sizeof(buffer))) > 0; ) {
+        pending.append(buffer, n);
+        for (size_t end; (end = pending.find('\n')) != std::string::npos; ) {
+            std::string line = pending.substr(0, end);
+            pending.erase(0, end + 1);
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) submit(to, std::move(line));
+        }
+    }
+
+    to->wait_idle();
+    {
+        std::lock_guard guard(clients_lock);
+        open_clients.erase(fd);
+    }
+
+    close(fd);
+    live_clients--;
+    live_clients.notify_all();
+}
+
+int main(int argc, char **argv) {
+    std::string socket_path, book_file = "8-ply.bin";
+    for (int i = 1; i < argc; i++) {
+        std::string arg = argv[i];
+        if (arg == "--socket" && i + 1 < argc) {
+            socket_path = argv[++i];
+        } else if (arg == "--book" && i + 1 < argc) {
+            book_file = argv[++i];
+        } else if (arg == "--weak") {
+            weak = true;
+        }
+    }
+
+    solver::init(solver::memory_budget(argc, argv), solver::table_file(argc, argv));
+    solver::book.load(book_file);
+
+    // requests are solved in parallel, one per worker
+    solver::helpers = 0;
+
+    if (socket_path.empty()) {
+        auto to = std::make_shared<client>(STDIN_FILENO);
+        std::string line;
+        while (std::getline(std::cin, line)) {
+            if (!line.empty() && line.back() == '\r') line.pop_back();
+            if (!line.empty()) submit(to, std::move(line));
+        }
+
+        to->wait_idle();
+        return 0;
+    }
+
+    sockaddr_un addr{};
+    addr.sun_family = AF_UNIX;
+    if (socket_path.size() >= sizeof(addr.sun_path)) {
+        std::cerr << "socket path too long: " << socket_path << '\n';
+        return 1;
+    }
+
+    std::copy(socket_path.begin(), socket_path.end(), addr.sun_path);
+    unlink(socket_path.c_str());
+
+    listener = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (listener < 0 || bind(listener, reinterpret_cast<sockaddr*>(&addr), sizeof(addr)) != 0
+                     || listen(listener, SOMAXCONN) != 0) {
+        std::cerr << "failed to listen on " << socket_path << '\n';
+        return 1;
+    }
+
+    // a client hanging up early shouldn't take the server with it
+    std::signal(SIGPIPE, SIG_IGN);
+    std::signal(SIGINT, on_quit);
+    std::signal(SIGTERM, on_quit);
+
+    while (!quitting) {
+        int fd = accept(listener, nullptr, nullptr);
+        if (fd < 0) continue;
+
+        {
+            std::lock_guard guard(clients_lock);
+            open_clients.insert(fd);
+        }
+
+        live_clients++;
+        std::thread(serve_client, fd).detach();
+    }
+
+    close(listener);
+    unlink(socket_path.c_str());
+
+    // clients see the end of their input, answer what they have read and
+    // hang up
+    {
+        std::lock_guard guard(clients_lock);
+        for (int fd : open_clients) shutdown(fd, SHUT_RD);
+    }
+
+    for (int left; (left = live_clients.load()) != 0; ) {
+        live_clients.wait(left);
+    }
+}
@@ -1,7 +1,137 @@
 #include "solver.hpp"
 #include <iostream>
+#include <cstdlib>
+#include <cstring>
+
+namespace solver {
+    static constexpr uint32_t STOP_INTERVAL = 1024;
+
+    // per thread search state: how moves are ordered, and when to give up
+    thread_local std::array<int, position::WIDTH> order = ORDER;
+    thread_local std::stop_token stop;
+    thread_local std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+    thread_local bool aborted = false;
+    thread_local uint32_t ticks = 0;
+    thread_local move_history history;
+
+    /**
+     * Sets up this thread's search state for one search, and puts the old
+     * one back afterwards.
+     */
+    struct scoped_search {
+        std::array<int, position::WIDTH> old_order = order;
+        std::stop_token old_stop = stop;
+        std::chrono::steady_clock::time_point old_deadline = deadline;
+        bool old_aborted = aborted;
+
+        scoped_search(std::stop_token token, std::chrono::steady_clock::time_point until, int helper) {
+            for (int i = 0; i < position::WIDTH; i++) {
+                order[i] = ORDER[(i + helper) % position::WIDTH];
+            }
+
+            stop = std::move(token);
+            deadline = until;
+            aborted = false;
+        }
+
+        ~scoped_search() {
+            order = old_order;
+            stop = std::move(old_stop);
+            deadline = old_deadline;
+            aborted = old_aborted;
+        }
+    };
+
+    struct shared_search {
+        std::stop_source stop;
+        std::chrono::steady_clock::time_point deadline;
+
+        // helpers that are searching right now
+        std::atomic<int> running = 0;
+
+        // what finished helpers proved and counted
+        std::mutex mutex;
+        int lower = -position::WIN;
+        int upper = position::WIN;
+        search_stats totals;
+    };
+};
+
+std::ostream& solver::operator<<(std::ostream &out, const search_stats &s) {
+    return out << "nodes " << s.nodes
+               << " probes " << s.probes
+               << " hits " << s.hits << " (" << s.hit_rate() * 100 << "%)"
+               << " stores " << s.stores
+               << " overwrites " << s.overwrites
+               << " collisions " << s.collisions
+               << " book_hits " << s.book_hits
+               << " cutoffs " << s.cutoffs
+               << " first_cutoffs " << s.first_cutoffs << " (" << s.first_cutoff_rate() * 100 << "%)"
+               << " etc_cutoffs " << s.etc_cutoffs;
+}
+
+void solver::init(size_t table_bytes, const std::string &table_file) {
+    if (!table_file.empty()) {
+        // a table file starts out zeroed, and other processes may be using it
+        memo.attach(table_file, table_bytes, position::WIDTH << 8 | position::HEIGHT);
+        return;
+    }
+
+    memo.allocate(table_bytes);
+    reset();
+}
+
+void solver::reset() {
+    // touching the pages from every worker spreads the page faults out
+    size_t parts = tasks.size();
+    tasks.submit_range(0, parts, [parts](size_t i) { memo.clear(i, parts); }).get();
+}
+
+size_t solver::memory_budget(int argc, char **argv) {
+    size_t mb = DEFAULT_TABLE_MB;
+    if (const char *env = std::getenv("CONNECT4_TABLE_MB")) {
+        mb = std::strtoull(env, nullptr, 10);
+    }
+
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], "--table-mb") == 0) {
+            mb = std::strtoull(argv[i + 1], nullptr, 10);
+        }
+    }
+
+    return mb << 20;
+}
+
+std::string solver::table_file(int argc, char **argv) {
+    std::string file;
+    if (const char *env = std::getenv("CONNECT4_TABLE_FILE")) {
+        file = env;
+    }
+
+    for (int i = 1; i + 1 < argc; i++) {
+        if (std::strcmp(argv[i], "--table-file") == 0) {
+            file = argv[i + 1];
+        }
+    }
+
+    return file;
+}
 
 int solver::negamax(const position &cur, int alpha, int beta) {
+    if (++ticks % STOP_INTERVAL == 0
+        && (stop.stop_requested() || std::chrono::steady_clock::now() >= deadline)) aborted = true;
+    if (aborted) return 0;
+
+    const bool counting = STATS && collect_stats;
+    if (position::WIDTH * position::HEIGHT - cur.moves <= endgame_depth) {
+        uint64_t nodes = 0;
+        int calc = endgame::solve(cur, alpha, beta, nodes);
+        if (counting) stats.nodes += nodes;
+        return calc;
+    }
+
+    if (counting) stats.nodes++;
+
     auto valid = cur.non_losing_moves();
     if (valid == 0) {
         return -(position::WIDTH * position::HEIGHT - cur.moves) / 2;
@@ -16,6 +146,7 @@ int solver::negamax(const position &cur, int alpha, int beta) {
     }
 
     if (auto value = book.get_minimax(cur)) {
+        if (counting) stats.book_hits++;
         return value - position::WIN;
     }
 
@@ -35,69 +166,131 @@ int solver::negamax(const position &cur, int alpha, int beta) {
         if (alpha >= beta) return beta;
     }
 
-    key_t key = cur.key();
+    // mirrored positions share an entry, stored columns are in the
+    // canonical orientation
+    bool mirrored = cur.is_mirrored();
+    key_t key = cur.canonical_key();
     move_sorter moves;
-    uint64_t start = 0;
-    if (auto val = memo.get_val(key)) {
+    position::pos_t start = 0;
+    val_t val;
+    int col;
+    if (counting) stats.probes++;
+    if (memo.get(key, val, col)) {
+        if (counting) stats.hits++;
         if (val <= 2 * position::WIN) {
             int lower = val - position::WIN;
             if (alpha < lower) alpha = lower;
             if (alpha >= beta) return alpha;
-        } else if (val <= 5 * position::WIN) {
-            int exact = val - 4 * position::WIN;
+        } else if (val <= EXACT_BOUND + position::WIN) {
+            int exact = val - EXACT_BOUND;
             return exact;
         } else {
-            int upper = val - 8 * position::WIN;
+            int upper = val - UPPER_BOUND;
             if (upper < beta) beta = upper;
             if (alpha >= beta) return beta;
         }
 
-        start = memo.get_move(key);
-        moves.add(start, 255);
+        if (col >= 0 && mirrored) col = position::WIDTH - 1 - col;
+        if (col >= 0) start = valid & position::column_mask(col);
+        if (start) moves.add(start, INT32_MAX);
+    }
+
+    position::pos_t children[position::WIDTH];
+    int child_count = 0;
+    for (int i : order) {
+        position::pos_t move = valid & position::column_mask(i);
+        if (move && move != start) children[child_count++] = move;
+    }
+
+    int scores[position::WIDTH];
+    threats::child_scores(cur.board, cur.flip, children, child_count, scores);
+    for (int i = 0; i < child_count; i++) {
+        moves.add(children[i], history_ordering ? history.score(cur, children[i], scores[i]) : scores[i]);
     }
 
-    for (int i : ORDER) {
-        if (uint64_t move = valid & position::column_mask(i)) {
-            if (move != start) moves.add(move, cur.get_score(move));
+    int depth = position::WIDTH * position::HEIGHT - cur.moves;
+    const auto store = [&](position::pos_t move, int value) {
+        int col = position::column_of(move);
+        auto res = memo.put(key, mirrored ? position::WIDTH - 1 - col : col, value, depth);
+        if (counting) {
+            stats.stores++;
+            if (res == decltype(memo)::stored::updated) stats.overwrites++;
+            if (res == decltype(memo)::stored::evicted) stats.collisions++;
+        }
+    };
+
+    if (enhanced_cutoffs && depth >= etc_depth) {
+        // a child's upper bound is a lower bound for us
+        key_t child_keys[position::WIDTH];
+        for (int i = 0; i < moves.size; i++) {
+            position nxt = cur;
+            nxt.play(moves.entries[i].move);
+            child_keys[i] = nxt.canonical_key();
+            memo.prefetch(child_keys[i]);
+        }
+
+        for (int i = moves.size - 1; i >= 0; i--) {
+            if (!memo.get(child_keys[i], val, col) || val <= 2 * position::WIN) continue;
+            int lower = -(val <= EXACT_BOUND + position::WIN ? val - EXACT_BOUND : val - UPPER_BOUND);
+            if (lower >= beta) {
+                if (counting) stats.etc_cutoffs++;
+                store(moves.entries[i].move, lower + position::WIN);
+                return lower;
+            }
         }
     }
 
     int exact = -position::WIN - 1;
     int original_alpha = alpha;
-    uint64_t best_move = 0;
-    while (uint64_t move = moves.get_next()) {
+    position::pos_t best_move = 0;
+    bool first = true;
+    position::pos_t tried[position::WIDTH];
+    int tried_count = 0;
+    while (position::pos_t move = moves.get_next()) {
+        tried[tried_count++] = move;
+
         position nxt = cur;
         nxt.play(move);
 
         int calc = -negamax(nxt, -beta, -alpha);
+        if (aborted) return 0;
+
         if (calc > exact) exact = calc, best_move = move;
         if (calc > alpha) alpha = calc;
         if (alpha >= beta) {
-            memo.put(key, best_move, alpha + position::WIN);
+            if (counting) {
+                stats.cutoffs++;
+                if (first) stats.first_cutoffs++;
+            }
+
+            if (history_ordering && !first) history.cutoff(cur, tried, tried_count);
+            store(best_move, alpha + position::WIN);
             return alpha;
         }
+
+        first = false;
     }
 
     if (exact <= original_alpha) {
-        memo.put(key, best_move, exact + 8 * position::WIN);
+        store(best_move, exact + UPPER_BOUND);
     } else {
-        memo.put(key, best_move, exact + 4 * position::WIN);
+        store(best_move, exact + EXACT_BOUND);
     }
     
     return exact;
 }
 
-int solver::solve(const position &cur, bool weak) {
-    if (cur.has_winning_move()) {
-        return (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2;
-    }
-
-    if (!cur.non_losing_moves()) {
-        return -(position::WIDTH * position::HEIGHT - cur.moves) / 2;
-    }
-
+solver::outcome solver::search(const position &cur, bool weak) {
     int min = -(position::WIDTH * position::HEIGHT - cur.moves) / 2;
     int max = (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2;
+    if (weak) {
+        min = std::max(min, -1);
+        max = std::min(max, 1);
+    }
+
+    // what was learned about other positions is noise here, and clearing
+    // keeps node counts reproducible
+    if (history_ordering) history.clear();
 
     // we basically use binary search to narrow window until converges
     while (min < max) {
@@ -105,7 +298,8 @@ int solver::solve(const position &cur, bool weak) {
         if (med <= 0 && min / 2 < med) med = min / 2;
         else if (med >= 0 && max / 2 > med) med = max / 2;
         int calc = solver::negamax(cur, med, med + 1);
-        
+        if (aborted) break;
+
         if (calc <= med) {
             max = calc;
         } else {
@@ -113,36 +307,184 @@ int solver::solve(const position &cur, bool weak) {
         }
     }
 
-    return min;
+    // negamax still answers in exact scores, so min can end up past +-1
+    if (weak) return {(min > 0) - (min < 0), (max > 0) - (max < 0)};
+    return {min, max};
 }
 
-std::array<int, position::WIDTH> solver::analyze(const position &cur, bool weak) {
-    std::array<std::future<int>, position::WIDTH> results{};
-    for (int i = 0; i < position::WIDTH; i++) {
-        results[i] = tasks.submit([=] {
-            if (!cur.can_play(i)) return solver::INVALID_MOVE;
-            auto nxt = cur;
-            nxt.play_col(i);
-            return -solver::solve(nxt, weak);
+solver::outcome solver::solve(const position &cur, bool weak, const limits &until, search_stats *out) {
+    if (cur.has_winning_move()) {
+        int score = weak ? 1 : (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2;
+        return {score, score};
+    }
+
+    if (!cur.non_losing_moves()) {
+        int score = weak ? -1 : -(position::WIDTH * position::HEIGHT - cur.moves) / 2;
+        return {score, score};
+    }
+
+    search_stats before = stats;
+    std::stop_token closing = until.on_shutdown ? tasks.stop_token() : std::stop_token{};
+    if (helpers <= 0 && !until.stop.stop_possible()) {
+        // nobody else to stop, so no need for the shared state
+        outcome calc;
+        {
+            scoped_search scope(closing, until.deadline, 0);
+            calc = search(cur, weak);
+        }
+
+        if (out) *out += stats - before;
+        return calc;
+    }
+
+    auto shared = std::make_shared<shared_search>();
+    shared->deadline = until.deadline;
+
+    // stopping from outside or shutting the pool down stops every searcher
+    std::stop_callback outside(until.stop, [&shared] { shared->stop.request_stop(); });
+    std::stop_callback shutdown(closing, [&shared] { shared->stop.request_stop(); });
+
+    // helpers that only get a worker after we are done just return, so we
+    // only ever wait on ones that are already searching, and they stop
+    // within STOP_INTERVAL nodes
+    for (int k = 1; k <= helpers; k++) {
+        tasks.execute([shared, cur, weak, k] {
+            shared->running++;
+            if (!shared->stop.stop_requested()) {
+                search_stats before = stats;
+                scoped_search scope(shared->stop.get_token(), shared->deadline, k);
+                outcome calc = search(cur, weak);
+                if (calc.finished()) shared->stop.request_stop();
+
+                std::lock_guard lock(shared->mutex);
+                shared->lower = std::max(shared->lower, calc.lower);
+                shared->upper = std::min(shared->upper, calc.upper);
+                shared->totals += stats - before;
+            }
+
+            shared->running--;
+            shared->running.notify_all();
         });
     }
 
-    std::array<int, position::WIDTH> pulled{};
-    for (int i = 0; i < position::WIDTH; i++) {
-        pulled[i] = results[i].get();
+    outcome calc;
+    {
+        scoped_search scope(shared->stop.get_token(), until.deadline, 0);
+        calc = search(cur, weak);
+    }
+
+    shared->stop.request_stop();
+    for (int left; (left = shared->running.load()) != 0; ) {
+        shared->running.wait(left);
+    }
+
+    // every searcher's bounds hold, so a helper that finished first or got
+    // further before being stopped tightens ours
+    std::lock_guard lock(shared->mutex);
+    calc.lower = std::max(calc.lower, shared->lower);
+    calc.upper = std::min(calc.upper, shared->upper);
+    if (out) {
+        *out += stats - before;
+        *out += shared->totals;
+    }
+
+    return calc;
+}
+
+int solver::solve(const position &cur, bool weak, search_stats *out) {
+    // answers nobody can tell apart from a score must never be cut short
+    limits unlimited;
+    unlimited.on_shutdown = false;
+    return solve(cur, weak, unlimited, out).lower;
+}
+
+std::array<solver::outcome, position::WIDTH> solver::analyze(const position &cur, bool weak, const limits &until,
+                                                             search_stats *out) {
+    // no column can do better than winning right away, and if none can,
+    // than winning with the next move
+    int best_possible = cur.has_winning_move() ? (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2
+                                               : (position::WIDTH * position::HEIGHT - 1 - cur.moves) / 2;
+    if (weak) best_possible = std::min(best_possible, 1);
+
+    // columns stop each other through siblings. The tasks share it and keep
+    // their own copy of the limits, if this throws they can outlive it
+    auto siblings = std::make_shared<std::stop_source>();
+    std::stop_callback outside(until.stop, [siblings] { siblings->request_stop(); });
+
+    std::array<std::future<std::pair<outcome, search_stats>>, position::WIDTH> results{};
+    std::array<outcome, position::WIDTH> pulled{};
+    try {
+        for (int i = 0; i < position::WIDTH; i++) {
+            results[i] = tasks.submit([siblings, until, cur, weak, best_possible, i] {
+                search_stats counted;
+                if (!cur.can_play(i)) return std::pair{outcome{INVALID_MOVE, INVALID_MOVE}, counted};
+
+                outcome calc;
+                if (cur.is_winning_move(i)) {
+                    int score = weak ? 1 : (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2;
+                    calc = {score, score};
+                } else {
+                    auto nxt = cur;
+                    nxt.play_col(i);
+                    outcome res = solve(nxt, weak, limits{siblings->get_token(), until.deadline, until.on_shutdown}, &counted);
+                    calc = {-res.upper, -res.lower};
+                }
+
+                if (calc.lower >= best_possible) siblings->request_stop();
+                return std::pair{calc, counted};
+            });
+        }
+
+        for (int i = 0; i < position::WIDTH; i++) {
+            auto [calc, counted] = results[i].get();
+            pulled[i] = calc;
+            if (out) *out += counted;
+        }
+    } catch (...) {
+        // nobody is going to read the columns still running
+        siblings->request_stop();
+        throw;
     }
 
     return pulled;
 }
 
-int solver::get_best_move(const position &cur, bool weak) {
-    auto res = analyze(cur, weak);
+int solver::get_best_move(const position &cur, bool weak, const limits &until, search_stats *out) {
+    auto res = analyze(cur, weak, until, out);
     int best = 0;
     for (int i = 1; i < position::WIDTH; i++) {
-        if (res[i] > res[best]) {
+        if (res[i].lower > res[best].lower) {
             best = i;
         }
     }
 
     return best;
-}
\ No newline at end of file
+}
+
+std::pair<int, int> solver::score_and_move(const position &cur, bool weak, search_stats *out) {
+    for (int i = 0; i < position::WIDTH; i++) {
+        if (cur.can_play(i) && cur.is_winning_move(i)) {
+            return {i, weak ? 1 : (position::WIDTH * position::HEIGHT + 1 - cur.moves) / 2};
+        }
+    }
+
+    int score = solve(cur, weak, out);
+
+    // every move loses right away, any of them will do
+    auto valid = cur.non_losing_moves();
+    if (!valid) valid = cur.possible();
+
+    int best = -1;
+    for (int i = position::WIDTH - 1; i >= 0; i--) {
+        int col = ORDER[i];
+        if (!(valid & position::column_mask(col))) continue;
+
+        position nxt = cur;
+        nxt.play_col(col);
+        int calc = -solve(nxt, weak, out);
+        if (best < 0 || calc == score) best = col;
+        if (calc == score) break;
+    }
+
+    return {best, score};
+}
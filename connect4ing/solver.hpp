@@ -1,28 +1,241 @@
 #include <array>
+#include <chrono>
+#include <mutex>
+#include <stop_token>
 #include "transposition_table.hpp"
 #include "opening_book.hpp"
 #include "thread_pool.hpp"
 #include "position.hpp"
 #include "move_sorter.hpp"
+#include "endgame.hpp"
+#include "threats.hpp"
 
 namespace solver {
-    static constexpr int TABLE_SIZE = 1 << 23;
-    using key_t = uint64_t;
+    static constexpr size_t DEFAULT_TABLE_MB = 128;
+    static constexpr int KEY_BITS = position::WIDTH * (position::HEIGHT + 1);
+    using key_t = position::pos_t;
     using val_t = uint8_t;
-    thread_local transposition_table<key_t, val_t, TABLE_SIZE> memo;
+
+    // memo values: lower bounds are stored as score + WIN, exact scores as
+    // score + EXACT_BOUND and upper bounds as score + UPPER_BOUND
+    static constexpr int EXACT_BOUND = 3 * position::WIN;
+    static constexpr int UPPER_BOUND = 5 * position::WIN;
+    static_assert(UPPER_BOUND + position::WIN <= 256, "memo values must fit in val_t");
+
+    // shared by every worker, entries are single words so races are harmless
+    transposition_table<key_t, val_t, KEY_BITS> memo;
+    static_assert(position::WIDTH <= decltype(memo)::MAX_COLUMNS, "best moves must fit in a memo entry");
+    static_assert(position::WIDTH * position::HEIGHT <= decltype(memo)::MAX_DEPTH, "depths must fit in a memo entry");
     
     static constexpr int INVALID_MOVE = -1000;
-    constexpr std::array<int, 7> ORDER = {0, 6, 1, 5, 2, 4, 3};
+    // edges first, center last: moves with equal scores pop off
+    // move_sorter center first
+    constexpr std::array<int, position::WIDTH> ORDER = [] {
+        std::array<int, position::WIDTH> res{};
+        for (int i = 0; i < position::WIDTH; i++) {
+            res[i] = i % 2 ? position::WIDTH - 1 - i / 2 : i / 2;
+        }
+
+        return res;
+    }();
 
     opening_book book;
 
     thread_pool tasks{};
 
+#ifndef CONNECT4_STATS
+#define CONNECT4_STATS 1
+#endif
+
+    // build with -DCONNECT4_STATS=0 to compile the counters out entirely
+    static constexpr bool STATS = CONNECT4_STATS;
+
+    // turns the counters on at runtime, only matters if STATS
+    bool collect_stats = false;
+
+    /**
+     * Search counters. Each thread counts into its own copy, solve() and
+     * analyze() add up what their searches counted if asked to.
+     */
+    struct search_stats {
+        uint64_t nodes = 0;
+        uint64_t probes = 0;        // table lookups
+        uint64_t hits = 0;          // table lookups that found the position
+        uint64_t stores = 0;        // table writes
+        uint64_t overwrites = 0;    // writes that updated the position's own entry
+        uint64_t collisions = 0;    // writes that evicted another position
+        uint64_t book_hits = 0;
+        uint64_t cutoffs = 0;       // nodes that failed high
+        uint64_t first_cutoffs = 0; // ... on the first move tried
+        uint64_t etc_cutoffs = 0;   // nodes cut off by a child's table entry
+
+        search_stats& operator+=(const search_stats &o) {
+            nodes += o.nodes;
+            probes += o.probes;
+            hits += o.hits;
+            stores += o.stores;
+            overwrites += o.overwrites;
+            collisions += o.collisions;
+            book_hits += o.book_hits;
+            cutoffs += o.cutoffs;
+            first_cutoffs += o.first_cutoffs;
+            etc_cutoffs += o.etc_cutoffs;
+            return *this;
+        }
+
+        search_stats operator-(const search_stats &o) const {
+            search_stats res = *this;
+            res.nodes -= o.nodes;
+            res.probes -= o.probes;
+            res.hits -= o.hits;
+            res.stores -= o.stores;
+            res.overwrites -= o.overwrites;
+            res.collisions -= o.collisions;
+            res.book_hits -= o.book_hits;
+            res.cutoffs -= o.cutoffs;
+            res.first_cutoffs -= o.first_cutoffs;
+            res.etc_cutoffs -= o.etc_cutoffs;
+            return res;
+        }
+
+        double hit_rate() const {
+            return probes ? double(hits) / probes : 0;
+        }
+
+        double first_cutoff_rate() const {
+            return cutoffs ? double(first_cutoffs) / cutoffs : 0;
+        }
+    };
+
+    thread_local search_stats stats;
+
+    // order moves with equal threats by move_history instead of just
+    // center first. Off by default, it costs more nodes than it saves on
+    // early positions
+    bool history_ordering = false;
+
+    // enhanced transposition cutoffs: before searching any child, check
+    // whether one's table entry already proves a cutoff. Only done with
+    // at least etc_depth empty cells left. Positions with endgame_depth or
+    // fewer empty cells never get that far, so this only matters when
+    // endgame_depth is below it, e.g. with the endgame solver off; there
+    // the probes near the leaves cost about as much as they save
+    bool enhanced_cutoffs = true;
+    int etc_depth = 4;
+
+    // positions with at most this many empty cells go to endgame::solve,
+    // at most endgame::MAX_EMPTY
+    int endgame_depth = 10;
+
+    std::ostream& operator<<(std::ostream &out, const search_stats &s);
+
+    // how many extra workers solve() puts on the same position
+    int helpers = int(std::thread::hardware_concurrency()) - 1;
+
+    /**
+     * Allocates the transposition table and clears it on every worker.
+     * Must be called before anything is solved.
+     *
+     * With a table file, the table is mapped from it instead and what
+     * earlier runs stored is kept. An existing file keeps its size, delete
+     * it to change table_bytes. A file made for another build or board
+     * size is rejected with std::runtime_error.
+     *
+     * @param table_bytes: memory budget for the table
+     * @param table_file: file to keep the table in, empty for memory only
+     */
+    void init(size_t table_bytes, const std::string &table_file = "");
+
+    /**
+     * Empties the transposition table, clearing a slice on every worker.
+     */
+    void reset();
+
+    /**
+     * @return table budget in bytes, from --table-mb <MB>, otherwise the
+     *         CONNECT4_TABLE_MB environment variable, otherwise the default
+     */
+    size_t memory_budget(int argc, char **argv);
+
+    /**
+     * @return table file from --table-file <PATH>, otherwise the
+     *         CONNECT4_TABLE_FILE environment variable, otherwise none
+     */
+    std::string table_file(int argc, char **argv);
+
+    /**
+     * When a search has to give up: once stop is requested, the deadline
+     * passes or, unless on_shutdown is off, the pool shuts down, whichever
+     * comes first. All of them are checked every STOP_INTERVAL nodes.
+     */
+    struct limits {
+        std::stop_token stop;
+        std::chrono::steady_clock::time_point deadline = std::chrono::steady_clock::time_point::max();
+        bool on_shutdown = true;
+    };
+
+    /**
+     * What a search proved: the score is in [lower, upper], so a search
+     * that got to the end has lower == upper.
+     */
+    struct outcome {
+        int lower;
+        int upper;
+
+        bool finished() const {
+            return lower == upper;
+        }
+    };
+
     int negamax(const position &cur, int alpha, int beta);
 
-    int solve(const position &cur, bool weak);
+    /**
+     * Narrows down the score of cur with null window searches, on this
+     * thread only, until it is known or the search is stopped.
+     *
+     * @param weak: only find out if cur is won, drawn or lost. The search
+     *              stays inside [-1, 1] and the bounds are 1, 0 or -1
+     */
+    outcome search(const position &cur, bool weak);
+
+    /**
+     * Lazy SMP: helpers search the same position on other workers with
+     * their moves ordered differently, all sharing memo. Whoever finishes
+     * first answers and stops the rest.
+     *
+     * The search also stops when until says so, and then answers with the
+     * tightest bounds any searcher proved.
+     *
+     * @param out: if set, gets what every searcher on cur counted added
+     */
+    outcome solve(const position &cur, bool weak, const limits &until, search_stats *out = nullptr);
+
+    /**
+     * solve() with no limits at all, not even the pool shutting down, so
+     * the score is always exact.
+     */
+    int solve(const position &cur, bool weak, search_stats *out = nullptr);
+
+    /**
+     * Solves every column of cur in parallel. As soon as one column gets
+     * the best score any column could have, the others are stopped and
+     * only have bounds. Full columns get INVALID_MOVE.
+     */
+    std::array<outcome, position::WIDTH> analyze(const position &cur, bool weak, const limits &until = {},
+                                                 search_stats *out = nullptr);
 
-    std::array<int, position::WIDTH> analyze(const position &cur, bool weak);
+    /**
+     * @return the column with the best proven score, the first one on ties
+     */
+    int get_best_move(const position &cur, bool weak, const limits &until = {}, search_stats *out = nullptr);
 
-    int get_best_move(const position &cur, bool weak);
+    /**
+     * Scores cur and finds a move that keeps that score without analyze(),
+     * so it is safe to call from a worker. Winning moves are taken right
+     * away, otherwise columns are tried center first and the first one
+     * that keeps the score is the answer.
+     *
+     * @return (column, score)
+     */
+    std::pair<int, int> score_and_move(const position &cur, bool weak, search_stats *out = nullptr);
 };
\ No newline at end of file
@@ -1,7 +1,7 @@
 #pragma once
 
 #include <vector>
-#include <queue>
+#include <cstddef>
 #include <thread>
 #include <future>
 #include <functional>
@@ -9,18 +9,169 @@
 #include <condition_variable>
 #include <stop_token>
 #include <type_traits>
+#include <atomic>
+#include <memory>
+#include <exception>
+#include <stdexcept>
+#include <new>
+#include <utility>
 
 #include <iostream>
 
-class thread_pool {
+/**
+ * Move-only type erased callable. Anything up to INLINE_SIZE bytes lives
+ * inside the task itself, so wrapping the usual lambda never allocates.
+ */
+class task {
+public:
+    static constexpr std::size_t INLINE_SIZE = 128;
+
+    task() = default;
+
+    template <typename F, typename = std::enable_if_t<!std::is_same_v<std::decay_t<F>, task>>>
+    task(F&& f) {
+        using fn_t = std::decay_t<F>;
+        if constexpr (sizeof(fn_t) <= INLINE_SIZE && alignof(fn_t) <= alignof(std::max_align_t)
+                   && std::is_nothrow_move_constructible_v<fn_t>) {
+            new (storage) fn_t(std::forward<F>(f));
+            ops = &inline_ops<fn_t>;
+        } else {
+            new (storage) fn_t*(new fn_t(std::forward<F>(f)));
+            ops = &heap_ops<fn_t>;
+        }
+    }
+
+    task(task&& other) noexcept {
+        take(other);
+    }
+
+    task& operator=(task&& other) noexcept {
+        if (this != &other) {
+            reset();
+            take(other);
+        }
+
+        return *this;
+    }
+
+    task(const task&) = delete;
+    task& operator=(const task&) = delete;
+
+    ~task() {
+        reset();
+    }
+
+    explicit operator bool() const {
+        return ops != nullptr;
+    }
+
+    void operator()() {
+        ops->call(storage);
+    }
+
+private:
+    struct vtable {
+        void (*call)(void*);
+        void (*move)(void*, void*);
+        void (*destroy)(void*);
+    };
+
+    template <typename fn_t>
+    static constexpr vtable inline_ops = {
+        [](void *p) { (*static_cast<fn_t*>(p))(); },
+        [](void *from, void *to) {
+            new (to) fn_t(std::move(*static_cast<fn_t*>(from)));
+            static_cast<fn_t*>(from)->~fn_t();
+        },
+        [](void *p) { static_cast<fn_t*>(p)->~fn_t(); },
+    };
+
+    template <typename fn_t>
+    static constexpr vtable heap_ops = {
+        [](void *p) { (**static_cast<fn_t**>(p))(); },
+        [](void *from, void *to) { new (to) fn_t*(*static_cast<fn_t**>(from)); },
+        [](void *p) { delete *static_cast<fn_t**>(p); },
+    };
+
+    void take(task &other) {
+        ops = other.ops;
+        if (ops) ops->move(other.storage, storage);
+        other.ops = nullptr;
+    }
+
+    void reset() {
+        if (ops) ops->destroy(storage);
+        ops = nullptr;
+    }
+
+    alignas(std::max_align_t) unsigned char storage[INLINE_SIZE];
+    const vtable *ops = nullptr;
+};
+
+/**
+ * Double ended queue of tasks in a ring that only ever grows, so once it
+ * has held the most tasks it will hold at once, pushing never allocates.
+ * Not thread safe.
+ */
+class task_ring {
 public:
-    explicit thread_pool(std::size_t thread_count = std::thread::hardware_concurrency()) {
-        if (thread_count == 0) thread_count = 1;
+    bool empty() const {
+        return count == 0;
+    }
+
+    void push_back(task &&t) {
+        if (count == slots.size()) grow();
+        slots[(head + count) & (slots.size() - 1)] = std::move(t);
+        count++;
+    }
+
+    task pop_back() {
+        count--;
+        return std::move(slots[(head + count) & (slots.size() - 1)]);
+    }
+
+    task pop_front() {
+        task t = std::move(slots[head]);
+        head = (head + 1) & (slots.size() - 1);
+        count--;
+        return t;
+    }
+
+private:
+    static constexpr std::size_t INITIAL_SIZE = 256;
+
+    void grow() {
+        std::vector<task> bigger(slots.empty() ? INITIAL_SIZE : slots.size() * 2);
+        for (std::size_t i = 0; i < count; i++) {
+            bigger[i] = std::move(slots[(head + i) & (slots.size() - 1)]);
+        }
+
+        slots = std::move(bigger);
+        head = 0;
+    }
+
+    // size is always a power of 2
+    std::vector<task> slots;
+    std::size_t head = 0;
+    std::size_t count = 0;
+};
 
+/**
+ * Each worker owns a task_ring. Tasks submitted from a worker go on its own
+ * ring, tasks from anywhere else are dealt out round robin. A worker pops
+ * the newest task off its own ring, and when that is empty steals the
+ * oldest task from someone else's.
+ */
+class thread_pool {
+public:
+    explicit thread_pool(std::size_t thread_count = std::thread::hardware_concurrency())
+        : queues(thread_count == 0 ? 1 : thread_count)
+    {
+        thread_count = queues.size();
         workers.reserve(thread_count);
         for (std::size_t i = 0; i < thread_count; ++i) {
-            workers.emplace_back([this](std::stop_token st) {
-                worker_loop(st);
+            workers.emplace_back([this, i](std::stop_token st) {
+                worker_loop(st, i);
             });
         }
     }
@@ -32,9 +183,19 @@ public:
     thread_pool(const thread_pool&) = delete;
     thread_pool& operator=(const thread_pool&) = delete;
 
+    /**
+     * @return how many workers the pool has
+     */
+    std::size_t size() const {
+        return queues.size();
+    }
+
     /**
      * Submit a task to the pool.
      * Works with lambdas, functions, functors, member functions, etc.
+     *
+     * The only allocation is the future's shared state, use execute() when
+     * the result isn't needed.
      */
     template <typename F, typename... Args>
     auto submit(F&& f, Args&&... args)
@@ -42,69 +203,205 @@ public:
     {
         using return_type = std::invoke_result_t<F, Args...>;
 
-        auto task = std::make_shared<std::packaged_task<return_type()>>(
-            std::bind(std::forward<F>(f), std::forward<Args>(args)...)
-        );
+        std::promise<return_type> promise;
+        std::future<return_type> result = promise.get_future();
+
+        execute([promise = std::move(promise), fn = std::forward<F>(f),
+                 ...bound = std::forward<Args>(args)]() mutable {
+            try {
+                if constexpr (std::is_void_v<return_type>) {
+                    std::invoke(std::move(fn), std::move(bound)...);
+                    promise.set_value();
+                } else {
+                    promise.set_value(std::invoke(std::move(fn), std::move(bound)...));
+                }
+            } catch (...) {
+                promise.set_exception(std::current_exception());
+            }
+        });
+
+        return result;
+    }
 
-        std::future<return_type> result = task->get_future();
+    /**
+     * Run f() on the pool without a way to wait for it. Does not allocate
+     * as long as f fits in a task and the target queue has held this many
+     * tasks before.
+     */
+    template <typename F>
+    void execute(F&& f) {
+        task next(std::forward<F>(f));
+        std::size_t target = current == this
+            ? current_index
+            : next_queue.fetch_add(1, std::memory_order_relaxed) % queues.size();
 
         {
-            std::lock_guard lock(queue_mutex);
-            if (stopped)
-                throw std::runtime_error("thread_pool is stopped");
+            // checked under the lock, so shutdown() sees every task that
+            // got past it once it has taken each queue's lock
+            std::lock_guard lock(queues[target].mutex);
+            if (stopped.load()) throw std::runtime_error("thread_pool is stopped");
+            queues[target].tasks.push_back(std::move(next));
+            pending.fetch_add(1);
+        }
 
-            tasks.emplace([task]() {
-                (*task)();
+        wake();
+    }
+
+    /**
+     * Calls f(i) for every i in [begin, end), split into chunks of chunk
+     * indices that run as separate tasks.
+     *
+     * @return future that is ready once every call has returned
+     */
+    template <typename F>
+    std::future<void> submit_range(std::size_t begin, std::size_t end, F&& f, std::size_t chunk = 1) {
+        struct batch {
+            std::decay_t<F> fn;
+            std::atomic<std::size_t> left;
+            std::promise<void> done;
+
+            // the first exception thrown by fn, the future gets it
+            std::atomic<bool> failed = false;
+            std::exception_ptr error;
+        };
+
+        if (chunk == 0) chunk = 1;
+        std::size_t chunks = begin < end ? (end - begin + chunk - 1) / chunk : 0;
+        auto shared = std::make_shared<batch>(std::forward<F>(f), chunks);
+        std::future<void> result = shared->done.get_future();
+        if (chunks == 0) {
+            shared->done.set_value();
+            return result;
+        }
+
+        for (std::size_t from = begin; from < end; from += chunk) {
+            std::size_t to = std::min(end, from + chunk);
+            execute([shared, from, to] {
+                try {
+                    for (std::size_t i = from; i < to; i++) shared->fn(i);
+                } catch (...) {
+                    if (!shared->failed.exchange(true)) shared->error = std::current_exception();
+                }
+
+                if (shared->left.fetch_sub(1, std::memory_order_acq_rel) == 1) {
+                    if (shared->error) shared->done.set_exception(shared->error);
+                    else shared->done.set_value();
+                }
             });
         }
 
-        cv.notify_one();
         return result;
     }
 
+    /**
+     * @return token that is stopped once shutdown() starts, long running
+     *         tasks can watch it to cut their work short
+     */
+    std::stop_token stop_token() const {
+        return stopping.get_token();
+    }
+
     /**
      * Explicit shutdown (optional, destructor already does this)
      */
     void shutdown() {
+        if (stopped.exchange(true)) return;
+        stopping.request_stop();
+
+        // a task that got past the check in execute() is queued and counted
+        // in pending once its queue's lock is free, so no worker quits
+        // before running it
+        for (auto &queue : queues) {
+            std::lock_guard lock(queue.mutex);
+        }
+
+        for (auto &worker : workers) worker.request_stop();
         {
-            std::lock_guard lock(queue_mutex);
-            if (stopped) return;
-            stopped = true;
+            std::lock_guard lock(sleep_mutex);
         }
 
         cv.notify_all();
-        workers.clear(); // jthread destructor requests stop + joins
+        workers.clear(); // joins
     }
 
 private:
-    void worker_loop(std::stop_token st) {
+    struct alignas(64) worker_queue {
+        std::mutex mutex;
+        task_ring tasks;
+    };
+
+    void wake() {
+        if (sleepers.load() > 0) {
+            { std::lock_guard lock(sleep_mutex); }
+            cv.notify_one();
+        }
+    }
+
+    bool try_pop(std::size_t index, task &out) {
+        // own queue first, newest task
+        {
+            auto &own = queues[index];
+            std::lock_guard lock(own.mutex);
+            if (!own.tasks.empty()) {
+                out = own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        // then steal the oldest task from someone else
+        for (std::size_t k = 1; k < queues.size(); k++) {
+            auto &other = queues[(index + k) % queues.size()];
+            std::lock_guard lock(other.mutex);
+            if (!other.tasks.empty()) {
+                out = other.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void worker_loop(std::stop_token st, std::size_t index) {
+        current = this;
+        current_index = index;
+
         while (true) {
-            std::function<void()> task;
+            task next;
+            if (pending.load() > 0 && try_pop(index, next)) {
+                pending.fetch_sub(1);
+                next();
+                continue;
+            }
 
+            sleepers.fetch_add(1);
             {
-                std::unique_lock lock(queue_mutex);
-
+                std::unique_lock lock(sleep_mutex);
                 cv.wait(lock, [&] {
-                    return stopped || !tasks.empty() || st.stop_requested();
+                    return pending.load() > 0 || st.stop_requested();
                 });
-
-                if ((stopped || st.stop_requested()) && tasks.empty())
-                    return;
-
-                task = std::move(tasks.front());
-                tasks.pop();
             }
+            sleepers.fetch_sub(1);
 
-            task();
+            if (st.stop_requested() && pending.load() == 0)
+                return;
         }
     }
 
 private:
+    static inline thread_local thread_pool *current = nullptr;
+    static inline thread_local std::size_t current_index = 0;
+
+    std::vector<worker_queue> queues;
     std::vector<std::jthread> workers;
-    std::queue<std::function<void()>> tasks;
 
-    std::mutex queue_mutex;
+    std::atomic<std::size_t> next_queue = 0;
+    // tasks queued but not yet popped, counted under the queue's lock
+    std::atomic<long> pending = 0;
+    std::atomic<long> sleepers = 0;
+
+    std::mutex sleep_mutex;
     std::condition_variable cv;
 
-    bool stopped = false;
+    std::atomic<bool> stopped = false;
+    std::stop_source stopping;
 };
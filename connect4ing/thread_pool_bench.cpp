@@ -0,0 +1,135 @@
+#include "thread_pool.hpp"
+#include <queue>
+#include <chrono>
+#include <string>
+#include <cstdio>
+
+/**
+ * Measures per task overhead of thread_pool for 1 to 64 workers.
+ *
+ * usage: thread_pool_bench [tasks] [work]
+ *  tasks: tasks per measurement (default 200000)
+ *  work:  iterations of busy work per task (default 100)
+ */
+
+// the pool as it was before work stealing: one locked queue of
+// std::function, each holding a shared_ptr to a packaged_task
+class legacy_pool {
+public:
+    explicit legacy_pool(std::size_t thread_count) {
+        for (std::size_t i = 0; i < thread_count; ++i) {
+            workers.emplace_back([this](std::stop_token) {
+                while (true) {
+                    std::function<void()> next;
+                    {
+                        std::unique_lock lock(queue_mutex);
+                        cv.wait(lock, [&] { return stopped || !tasks.empty(); });
+                        if (stopped && tasks.empty()) return;
+                        next = std::move(tasks.front());
+                        tasks.pop();
+                    }
+
+                    next();
+                }
+            });
+        }
+    }
+
+    ~legacy_pool() {
+        {
+            std::lock_guard lock(queue_mutex);
+            stopped = true;
+        }
+
+        cv.notify_all();
+    }
+
+    template <typename F>
+    auto submit(F&& f) -> std::future<std::invoke_result_t<F>> {
+        using return_type = std::invoke_result_t<F>;
+        auto task = std::make_shared<std::packaged_task<return_type()>>(std::forward<F>(f));
+        std::future<return_type> result = task->get_future();
+        {
+            std::lock_guard lock(queue_mutex);
+            tasks.emplace([task]() { (*task)(); });
+        }
+
+        cv.notify_one();
+        return result;
+    }
+
+private:
+    std::queue<std::function<void()>> tasks;
+    std::mutex queue_mutex;
+    std::condition_variable cv;
+    bool stopped = false;
+    std::vector<std::jthread> workers;
+};
+
+std::atomic<uint64_t> sink = 0;
+
+void busy(int work) {
+    uint64_t x = work;
+    for (int i = 0; i < work; i++) {
+        x = x * 6364136223846793005ULL + 1442695040888963407ULL;
+    }
+
+    sink.fetch_add(x & 1, std::memory_order_relaxed);
+}
+
+template <typename F>
+double time_ns(F &&f, std::size_t tasks) {
+    auto start = std::chrono::steady_clock::now();
+    f();
+    auto end = std::chrono::steady_clock::now();
+    return std::chrono::duration<double, std::nano>(end - start).count() / tasks;
+}
+
+int main(int argc, char **argv) {
+    std::size_t tasks = argc > 1 ? std::stoul(argv[1]) : 200000;
+    int work = argc > 2 ? std::stoi(argv[2]) : 100;
+
+    std::printf("%7s %14s %14s %14s %14s\n", "threads", "legacy ns", "submit ns", "execute ns", "range ns");
+    for (std::size_t threads = 1; threads <= 64; threads *= 2) {
+        double legacy = 0, submit = 0, execute = 0, range = 0;
+
+        {
+            legacy_pool pool(threads);
+            legacy = time_ns([&] {
+                std::vector<std::future<void>> pending;
+                pending.reserve(tasks);
+                for (std::size_t i = 0; i < tasks; i++) pending.push_back(pool.submit([work] { busy(work); }));
+                for (auto &done : pending) done.get();
+            }, tasks);
+        }
+
+        {
+            thread_pool pool(threads);
+            submit = time_ns([&] {
+                std::vector<std::future<void>> pending;
+                pending.reserve(tasks);
+                for (std::size_t i = 0; i < tasks; i++) pending.push_back(pool.submit([work] { busy(work); }));
+                for (auto &done : pending) done.get();
+            }, tasks);
+
+            execute = time_ns([&] {
+                std::atomic<std::size_t> left = tasks;
+                std::promise<void> all;
+                for (std::size_t i = 0; i < tasks; i++) {
+                    pool.execute([&, work] {
+                        busy(work);
+                        if (left.fetch_sub(1) == 1) all.set_value();
+                    });
+                }
+
+                all.get_future().get();
+            }, tasks);
+
+            range = time_ns([&] {
+                pool.submit_range(0, tasks, [work](std::size_t) { busy(work); }, 64).get();
+            }, tasks);
+        }
+
+        std::printf("%7zu %14.1f %14.1f %14.1f %14.1f\n", threads, legacy, submit, execute, range);
+    }
+}
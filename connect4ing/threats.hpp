@@ -0,0 +1,74 @@
+#pragma once
+
+#include <cstdint>
+#include "position.hpp"
+
+/**
+ * Threat counts (what position::get_score() returns) for every child of
+ * a node in one go. The boards are packed into GCC vectors and run through
+ * position::winning_cells once, 4 lanes at a time with AVX2 or 8 with
+ * AVX-512. Which kernel runs is picked once at startup from what the CPU
+ * supports, boards wider than 64 bits and non-x86 targets always use the
+ * scalar one.
+ */
+namespace threats {
+    using pos_t = position::pos_t;
+
+    // child_scores(board, flip, moves, count, scores): scores[i] is the
+    // number of winning cells after playing moves[i] from board/flip
+    using kernel_t = void (*)(pos_t, pos_t, const pos_t*, int, int*);
+
+    inline void scores_scalar(pos_t board, pos_t flip, const pos_t *moves, int count, int *scores) {
+        for (int i = 0; i < count; i++) {
+            scores[i] = position::popcount(position::compute_winning_position(board | moves[i], flip | moves[i]));
+        }
+    }
+
+    template <typename vec, int LANES>
+    [[gnu::always_inline]] inline void scores_vector(pos_t board, pos_t flip, const pos_t *moves, int count, int *scores) {
+        for (int from = 0; from < count; from += LANES) {
+            vec m{};
+            for (int i = 0; i < LANES && from + i < count; i++) m[i] = moves[from + i];
+
+            vec cells;
+            position::winning_cells<vec>(board | m, flip | m, cells);
+            for (int i = 0; i < LANES && from + i < count; i++) scores[from + i] = __builtin_popcountll(cells[i]);
+        }
+    }
+
+#if defined(__x86_64__) || defined(__i386__)
+    using vec4 = uint64_t __attribute__((vector_size(32)));
+    using vec8 = uint64_t __attribute__((vector_size(64)));
+
+    [[gnu::target("avx2,popcnt")]]
+    inline void scores_avx2(pos_t board, pos_t flip, const pos_t *moves, int count, int *scores) {
+        if constexpr (sizeof(pos_t) == sizeof(uint64_t)) {
+            scores_vector<vec4, 4>(board, flip, moves, count, scores);
+        } else {
+            scores_scalar(board, flip, moves, count, scores);
+        }
+    }
+
+    [[gnu::target("avx512f,popcnt")]]
+    inline void scores_avx512(pos_t board, pos_t flip, const pos_t *moves, int count, int *scores) {
+        if constexpr (sizeof(pos_t) == sizeof(uint64_t)) {
+            scores_vector<vec8, 8>(board, flip, moves, count, scores);
+        } else {
+            scores_scalar(board, flip, moves, count, scores);
+        }
+    }
+
+    inline kernel_t pick_kernel() {
+        __builtin_cpu_init();
+        if (__builtin_cpu_supports("avx512f")) return scores_avx512;
+        if (__builtin_cpu_supports("avx2")) return scores_avx2;
+        return scores_scalar;
+    }
+#else
+    inline kernel_t pick_kernel() {
+        return scores_scalar;
+    }
+#endif
+
+    inline const kernel_t child_scores = pick_kernel();
+};
@@ -1,60 +1,372 @@
 #include <cstddef>
+#include <cstdint>
+#include <cstring>
 #include <cmath>
 #include <chrono>
+#include <atomic>
+#include <bit>
+#include <new>
+#include <string>
+#include <stdexcept>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
 
 /**
  * Just a hash table that sorta acts like a cache.
- * 
- * SIZE must be a power of 2, to make indexing fast and easy.
- * 
- * As our board representation is a number, and our associated value is 
- * also a number, we need to be able to do bit operations on themn.
+ *
+ * The size is picked at runtime from a memory budget, rounded down to a
+ * power of 2 number of buckets to make indexing fast and easy. Entries are
+ * grouped into 64 byte buckets of WAYS entries, so a probe only ever
+ * touches one cache line.
+ *
+ * The key is scrambled with a bijection on its low KEY_BITS bits. The low
+ * bits of the result pick the bucket, and the entry only keeps the next
+ * TAG_BITS bits: as long as the two together cover KEY_BITS, the bucket and
+ * tag still identify the key exactly. MIN_BYTES is the smallest table for
+ * which that holds.
+ *
+ * Keys too wide for that (EXACT is false, boards bigger than 7x6) are
+ * folded to 64 bits first and the tag is just a check, so two keys can
+ * share an entry with odds of about 2^-32 per probe.
+ *
+ * Each entry is one 64 bit word, so it is shared by every thread without
+ * locks and a racing write can never be seen half done.
+ *  bits  0-31: tag
+ *  bits 32-39: value (0 = empty)
+ *  bits 40-43: best move column + 1 (0 = none)
+ *  bits 44-50: depth, how many cells were left to fill below the entry
+ *  bits 51-63: generation the entry was written in, 13 bits so it only
+ *             wraps after GEN_MASK + 1 searches
+ *
+ * When a bucket is full, the entry to evict is the one that is cheapest to
+ * recompute (shallowest) once it is aged by how many generations ago it was
+ * written, so a deep entry from the current search is the last to go.
+ *
+ * The table can also live in a file (attach()), laid out as a file_header
+ * page followed by the buckets, so entries survive restarts. The header
+ * keeps the hash seed, otherwise nothing stored could be found again.
  */
-template <typename key_t, typename value_t, int SIZE> 
+template <typename key_t, typename value_t, int KEY_BITS = 8 * sizeof(key_t)>
 struct transposition_table {
-    static_assert((SIZE & (SIZE - 1)) == 0, "SIZE must be a power of 2");
+    static_assert(sizeof(value_t) == 1, "value_t must fit in a byte");
 
-    key_t key[SIZE];
-    key_t opt[SIZE];
-    value_t val[SIZE];
+    static constexpr int WAYS = 64 / sizeof(uint64_t);
+    static constexpr int TAG_BITS = 32;
+    static constexpr int HASH_BITS = KEY_BITS < 64 ? KEY_BITS : 64;
+    static constexpr uint64_t KEY_MASK = HASH_BITS == 64 ? ~uint64_t(0) : (uint64_t(1) << HASH_BITS) - 1;
+    static constexpr size_t HUGE_PAGE = size_t(1) << 21;
+    static constexpr int AGE_WEIGHT = 4;
+    static constexpr uint32_t GEN_MASK = (1 << 13) - 1;
 
-    uint64_t splitmix64(uint64_t x) const {
-        // http://xorshift.di.unimi.it/splitmix64.c
-        x += 0x9e3779b97f4a7c15;
-        x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9;
-        x = (x ^ (x >> 27)) * 0x94d049bb133111eb;
-        return x ^ (x >> 31);
+    // the widest board and the deepest search an entry can describe
+    static constexpr int MAX_COLUMNS = 15;
+    static constexpr int MAX_DEPTH = 127;
+
+    enum class replacement { always, depth_age };
+
+    // what a put() did to the bucket
+    enum class stored { fresh, updated, evicted };
+
+    struct alignas(64) bucket {
+        std::atomic<uint64_t> entries[WAYS];
+    };
+
+    // exact as long as that takes at most 2^20 buckets (64 MB)
+    static constexpr bool EXACT = KEY_BITS - TAG_BITS <= 20;
+    static constexpr size_t MIN_BYTES = sizeof(bucket) << (!EXACT ? 17 : KEY_BITS > TAG_BITS ? KEY_BITS - TAG_BITS : 0);
+
+    static constexpr char MAGIC[8] = {'C', '4', 'T', 'A', 'B', 'L', 'E', 0};
+
+    // bump whenever the entry layout or what values mean changes
+    static constexpr uint32_t VERSION = 3;
+
+    // first page of a table file, the buckets start right after it
+    struct file_header {
+        char magic[8];
+        uint32_t version;
+        uint32_t geometry;
+        uint32_t key_bits;
+        uint32_t generation;
+        uint64_t seed;
+        uint64_t buckets;
+    };
+
+    static constexpr size_t HEADER_BYTES = 4096;
+
+    bucket *table = nullptr;
+    size_t buckets = 0;
+    int index_bits = 0;
+    std::atomic<uint32_t> generation = 0;
+    replacement policy = replacement::depth_age;
+    uint64_t seed = 0;
+
+    // what we actually got from mmap, table is aligned inside it
+    void *region = nullptr;
+    size_t region_size = 0;
+
+    // only set for tables attached to a file
+    file_header *header = nullptr;
+
+    transposition_table() = default;
+
+    transposition_table(const transposition_table&) = delete;
+    transposition_table& operator=(const transposition_table&) = delete;
+
+    ~transposition_table() {
+        release();
     }
 
-    uint64_t hash(key_t key) const {
-        static const uint64_t FIXED_RANDOM = std::chrono::steady_clock::now().time_since_epoch().count();
-        return splitmix64(key + FIXED_RANDOM);
+    /**
+     * Maps a new table. Tries explicit hugepages first, then falls back to
+     * normal pages with transparent hugepages requested.
+     *
+     * Pages are only faulted in once touched, see clear().
+     *
+     * @param budget: most bytes the table may use, raised to MIN_BYTES
+     */
+    void allocate(size_t budget) {
+        release();
+
+        if (budget < MIN_BYTES) budget = MIN_BYTES;
+        buckets = std::bit_floor(budget / sizeof(bucket));
+        index_bits = std::countr_zero(buckets);
+        seed = std::chrono::steady_clock::now().time_since_epoch().count();
+
+        size_t bytes = buckets * sizeof(bucket);
+        if (bytes % HUGE_PAGE == 0) {
+            region = mmap(nullptr, bytes, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+            if (region != MAP_FAILED) {
+                region_size = bytes;
+                table = static_cast<bucket*>(region);
+                return;
+            }
+        }
+
+        // over-allocate so the table can start on a hugepage boundary
+        region_size = bytes + HUGE_PAGE;
+        region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+        if (region == MAP_FAILED) {
+            region = nullptr;
+            release();
+            throw std::bad_alloc();
+        }
+
+        uintptr_t start = (reinterpret_cast<uintptr_t>(region) + HUGE_PAGE - 1) & ~(HUGE_PAGE - 1);
+        table = reinterpret_cast<bucket*>(start);
+#ifdef MADV_HUGEPAGE
+        madvise(table, bytes, MADV_HUGEPAGE);
+#endif
     }
 
-    size_t index(key_t key) const {
-        return hash(key) & (SIZE - 1);
+    /**
+     * Maps the table from file_name, creating the file if it doesn't exist.
+     * A file whose header doesn't match (other version, geometry or key
+     * size) is never touched, it may be in use by another build.
+     *
+     * An existing file keeps its size, so budget only applies to new ones.
+     * Several processes can attach to the same file: checking or creating
+     * the header happens under an exclusive flock, so they all agree on
+     * the seed, and every entry is a single word.
+     *
+     * @param geometry: describes what the keys mean (the board size),
+     *                  a file made for another geometry is rejected
+     * @return if an existing table was attached, false if it is new and
+     *         empty
+     * @throws std::runtime_error if the file can't be used
+     */
+    bool attach(const std::string &file_name, size_t budget, uint32_t geometry) {
+        release();
+
+        int fd = open(file_name.c_str(), O_RDWR | O_CREAT, 0644);
+        if (fd < 0) throw std::runtime_error("failed to open " + file_name);
+
+        // released by close(), once the table is mapped
+        const auto fail = [&](const std::string &why) {
+            close(fd);
+            throw std::runtime_error(why + ": " + file_name);
+        };
+
+        if (flock(fd, LOCK_EX) != 0) fail("failed to lock");
+
+        struct stat st;
+        if (fstat(fd, &st) != 0) fail("failed to stat");
+
+        file_header head{};
+        bool reuse = st.st_size != 0;
+        if (reuse) {
+            bool valid = size_t(st.st_size) >= HEADER_BYTES
+                      && pread(fd, &head, sizeof(head), 0) == sizeof(head)
+                      && std::memcmp(head.magic, MAGIC, sizeof(MAGIC)) == 0
+                      && head.version == VERSION && head.geometry == geometry && head.key_bits == KEY_BITS
+                      && std::has_single_bit(head.buckets)
+                      && size_t(st.st_size) == HEADER_BYTES + head.buckets * sizeof(bucket);
+            if (!valid) fail("not a table for this build, delete it to start over");
+        } else {
+            if (budget < MIN_BYTES) budget = MIN_BYTES;
+            std::memcpy(head.magic, MAGIC, sizeof(MAGIC));
+            head.version = VERSION;
+            head.geometry = geometry;
+            head.key_bits = KEY_BITS;
+            head.generation = 0;
+            head.seed = std::chrono::steady_clock::now().time_since_epoch().count();
+            head.buckets = std::bit_floor(budget / sizeof(bucket));
+
+            // a new file reads as zeros, i.e. every bucket is empty
+            if (ftruncate(fd, HEADER_BYTES + head.buckets * sizeof(bucket)) != 0
+             || pwrite(fd, &head, sizeof(head), 0) != sizeof(head)) {
+                fail("failed to create");
+            }
+        }
+
+        region_size = HEADER_BYTES + head.buckets * sizeof(bucket);
+        region = mmap(nullptr, region_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+        if (region == MAP_FAILED) {
+            region = nullptr;
+            region_size = 0;
+            fail("failed to map");
+        }
+
+        close(fd);
+
+        header = static_cast<file_header*>(region);
+        table = reinterpret_cast<bucket*>(static_cast<char*>(region) + HEADER_BYTES);
+        buckets = head.buckets;
+        index_bits = std::countr_zero(buckets);
+        seed = head.seed;
+        generation = head.generation & GEN_MASK;
+        return reuse;
     }
 
-    bool has(key_t cur) {
-        auto loc = index(cur);
-        return key[loc] == cur && val[loc];
+    /**
+     * Writes a file backed table out to disk, does nothing otherwise.
+     */
+    void flush() {
+        if (!header) return;
+        header->generation = generation.load(std::memory_order_relaxed) & GEN_MASK;
+        msync(region, region_size, MS_SYNC);
     }
 
-    value_t get_val(key_t cur) {
-        auto loc = index(cur);
-        return key[loc] == cur ? val[loc] : 0;
+    void release() {
+        flush();
+        header = nullptr;
+        if (region) munmap(region, region_size);
+        table = nullptr;
+        region = nullptr;
+        region_size = buckets = 0;
+        index_bits = 0;
     }
 
-    key_t get_move(key_t cur) { 
-        auto loc = index(cur);
-        return opt[loc]; 
+    /**
+     * @return size of the table in bytes
+     */
+    size_t size() const {
+        return buckets * sizeof(bucket);
     }
 
-    void put(key_t cur, key_t nxt, value_t new_val) {
-        auto loc = index(cur);
+    /**
+     * Zeroes the part-th of parts equal slices of the table, so several
+     * threads can clear (and fault in) the table at once.
+     */
+    void clear(size_t part = 0, size_t parts = 1) {
+        size_t from = buckets * part / parts;
+        size_t to = buckets * (part + 1) / parts;
+        std::memset(static_cast<void*>(table + from), 0, (to - from) * sizeof(bucket));
+    }
+
+    /**
+     * Starts a new search generation, older entries become easier to evict.
+     */
+    void next_generation() {
+        generation.fetch_add(1, std::memory_order_relaxed);
+    }
+
+    /**
+     * A bijection on [0, 2^KEY_BITS), so no two keys ever share a hash.
+     * Keys wider than 64 bits are folded down first.
+     */
+    uint64_t hash(key_t key) const {
+        uint64_t x = uint64_t(key);
+        if constexpr (sizeof(key_t) > sizeof(uint64_t)) x ^= uint64_t(key >> 64) * 0x9e3779b97f4a7c15;
+
+        x = (x ^ seed) & KEY_MASK;
+        x = (x * 0xbf58476d1ce4e5b9) & KEY_MASK;
+        x ^= x >> (HASH_BITS / 2);
+        x = (x * 0x94d049bb133111eb) & KEY_MASK;
+        x ^= x >> (HASH_BITS / 2);
+        return x;
+    }
+
+    /**
+     * @param cur: the key we are looking for
+     * @param val: filled with the stored value, 0 if cur isn't stored
+     * @param move: filled with the stored best column, -1 if there is none
+     * @return if cur is stored
+     */
+    bool get(key_t cur, value_t &val, int &move) const {
+        uint64_t h = hash(cur);
+        uint32_t tag = uint32_t(h >> index_bits);
+        const bucket &b = table[h & (buckets - 1)];
+
+        for (const auto &slot : b.entries) {
+            uint64_t e = slot.load(std::memory_order_relaxed);
+            if (uint32_t(e) == tag && value_t(e >> 32)) {
+                val = value_t(e >> 32);
+                move = int(e >> 40 & 15) - 1;
+                return true;
+            }
+        }
+
+        val = 0;
+        move = -1;
+        return false;
+    }
+
+    /**
+     * Starts pulling cur's bucket into cache, for a get() a little later.
+     */
+    void prefetch(key_t cur) const {
+        __builtin_prefetch(&table[hash(cur) & (buckets - 1)]);
+    }
+
+    /**
+     * @param cur: the key we are storing
+     * @param move: the best column found, or -1
+     * @param new_val: the value to store, must not be 0
+     * @param depth: empty cells left in the position, how costly it was
+     * @return whether the entry went into an empty way, replaced cur's own
+     *         entry or evicted another key
+     */
+    stored put(key_t cur, int move, value_t new_val, int depth) {
+        uint64_t h = hash(cur);
+        uint32_t tag = uint32_t(h >> index_bits);
+        bucket &b = table[h & (buckets - 1)];
+        uint32_t gen = generation.load(std::memory_order_relaxed) & GEN_MASK;
+        uint64_t e = uint64_t(gen) << 51 | uint64_t(depth) << 44
+                   | uint64_t(move + 1) << 40 | uint64_t(new_val) << 32 | tag;
+
+        // reuse the entry for this key or the first empty one, otherwise
+        // evict the least valuable way
+        int victim = tag & (WAYS - 1);
+        int worst = INT32_MAX;
+        uint64_t replaced = b.entries[victim].load(std::memory_order_relaxed);
+        for (int i = WAYS - 1; i >= 0; i--) {
+            uint64_t old = b.entries[i].load(std::memory_order_relaxed);
+            if (uint32_t(old) == tag || !value_t(old >> 32)) {
+                victim = i;
+                worst = INT32_MIN;
+                replaced = old;
+            } else if (policy == replacement::depth_age && worst != INT32_MIN) {
+                int age = (gen - uint32_t(old >> 51)) & GEN_MASK;
+                int worth = int(old >> 44 & MAX_DEPTH) - AGE_WEIGHT * age;
+                if (worth <= worst) victim = i, worst = worth, replaced = old;
+            }
+        }
 
-        key[loc] = cur;
-        opt[loc] = nxt;
-        val[loc] = new_val;
+        b.entries[victim].store(e, std::memory_order_relaxed);
+        if (!value_t(replaced >> 32)) return stored::fresh;
+        return uint32_t(replaced) == tag ? stored::updated : stored::evicted;
     }
-};
\ No newline at end of file
+};